@@ -0,0 +1,107 @@
+//===- DiskObjectCache.h - Persistent cache of JIT'd objects ----*- C++ -*-===//
+//
+// An ObjectCache that keeps compiled objects in a directory, one file per
+// entry, so they survive between runs. Callers can store and look up entries
+// directly; as an ObjectCache, only modules whose identifier was set with
+// getModuleID take part. The key is chosen by the caller and should cover
+// everything that affects the generated code.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef ISERE_DISKOBJECTCACHE_H
+#define ISERE_DISKOBJECTCACHE_H
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+#include <memory>
+#include <string>
+
+namespace llvm {
+namespace orc {
+
+class DiskObjectCache : public ObjectCache {
+  std::string Dir;
+
+  static constexpr StringRef ModuleIDPrefix = "isere-cache:";
+
+  std::string getPath(StringRef Key, StringRef Ext) const {
+    SmallString<256> Path(Dir);
+    sys::path::append(Path, Key + Ext);
+    return std::string(Path);
+  }
+
+public:
+  explicit DiskObjectCache(std::string Dir) : Dir(std::move(Dir)) {}
+
+  /// getModuleID - The module identifier that files a module's object under
+  /// Key once it has been compiled.
+  static std::string getModuleID(StringRef Key) {
+    return (ModuleIDPrefix + Key).str();
+  }
+
+  /// lookup - Return the object cached under Key, or null if there is none.
+  /// Ext selects another kind of file kept alongside it.
+  std::unique_ptr<MemoryBuffer> lookup(StringRef Key,
+                                       StringRef Ext = ".o") const {
+    auto Buf = MemoryBuffer::getFile(getPath(Key, Ext), /*IsText=*/false,
+                                     /*RequiresNullTerminator=*/false);
+    if (!Buf)
+      return nullptr;
+    return std::move(*Buf);
+  }
+
+  /// store - File Contents under Key, with extension Ext.
+  void store(StringRef Key, StringRef Contents, StringRef Ext = ".o") {
+    // Write to a temporary and rename it into place, so that concurrent runs
+    // never see a partial entry.
+    std::string Path = getPath(Key, Ext);
+    SmallString<256> TmpPath;
+    int FD;
+    std::error_code EC = sys::fs::create_directories(Dir);
+    if (!EC)
+      EC = sys::fs::createUniqueFile(Path + ".%%%%%%.tmp", FD, TmpPath);
+    if (EC) {
+      errs() << "warning: could not write object cache entry '" << Path
+             << "': " << EC.message() << "\n";
+      return;
+    }
+    {
+      raw_fd_ostream OS(FD, /*shouldClose=*/true);
+      OS << Contents;
+      OS.close();
+      EC = OS.error();
+      OS.clear_error();
+    }
+    if (!EC)
+      EC = sys::fs::rename(TmpPath, Path);
+    if (EC) {
+      errs() << "warning: could not write object cache entry '" << Path
+             << "': " << EC.message() << "\n";
+      sys::fs::remove(TmpPath);
+    }
+  }
+
+  void notifyObjectCompiled(const Module *M, MemoryBufferRef Obj) override {
+    StringRef Key = M->getModuleIdentifier();
+    if (Key.consume_front(ModuleIDPrefix))
+      store(Key, Obj.getBuffer());
+  }
+
+  std::unique_ptr<MemoryBuffer> getObject(const Module *M) override {
+    StringRef Key = M->getModuleIdentifier();
+    if (!Key.consume_front(ModuleIDPrefix))
+      return nullptr;
+    return lookup(Key);
+  }
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif // ISERE_DISKOBJECTCACHE_H
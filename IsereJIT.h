@@ -0,0 +1,380 @@
+//===- IsereJIT.h - A simple JIT for Isere ----------------------*- C++ -*-===//
+//
+// Contains a simple JIT definition for use in the Isere REPL. Every module
+// handed to addModule is compiled to native code on demand, and symbols can be
+// looked up by name once their owning module has been added.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef ISERE_JIT_H
+#define ISERE_JIT_H
+
+#include "WorkStealingPool.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/STLFunctionalExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/ExecutionEngine/Orc/CompileOnDemandLayer.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/ExecutorProcessControl.h"
+#include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/IRTransformLayer.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/LazyReexports.h"
+#include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
+#include "llvm/ExecutionEngine/Orc/Shared/ExecutorAddress.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Target/TargetMachine.h"
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+namespace llvm {
+namespace orc {
+
+class IsereJIT {
+public:
+  /// MaxBatchColumns - The widest kernel runBatchKernel can call.
+  static constexpr size_t MaxBatchColumns = 8;
+
+private:
+  std::unique_ptr<ExecutionSession> ES;
+
+  DataLayout DL;
+  MangleAndInterner Mangle;
+
+  /// TargetID - Triple, CPU and features the JIT generates code for.
+  std::string TargetID;
+
+  /// Arities - The argument count of every function recordArity was told
+  /// of, which the columns passed to runBatchKernel and evaluateParallel
+  /// must match. Files compiled in parallel record theirs concurrently.
+  StringMap<size_t> Arities;
+  std::mutex ArityMutex;
+
+  /// ObjectJTMB/ObjectTM - The target compileModule generates code for, the
+  /// same one CompileLayer uses. The machine is created on first use.
+  JITTargetMachineBuilder ObjectJTMB;
+  std::unique_ptr<TargetMachine> ObjectTM;
+
+  std::unique_ptr<LazyCallThroughManager> LCTMgr;
+
+  /// StubsMgr - Stubs for the symbols defined with redirect.
+  std::unique_ptr<IndirectStubsManager> StubsMgr;
+
+  // Eagerly added modules go straight to CompileLayer. Lazily added ones
+  // enter at CODLayer, which hands each function to OptimizeLayer (and on to
+  // CompileLayer) only when it is first called.
+  RTDyldObjectLinkingLayer ObjectLayer;
+  IRCompileLayer CompileLayer;
+  IRTransformLayer OptimizeLayer;
+  CompileOnDemandLayer CODLayer;
+
+  JITDylib &MainJD;
+
+public:
+  /// IsereJIT - If Cache is given, every compiled module is offered to it and
+  /// modules it already holds an object for skip the backend.
+  IsereJIT(std::unique_ptr<ExecutionSession> ES,
+           std::unique_ptr<LazyCallThroughManager> LCTMgr,
+           JITTargetMachineBuilder JTMB, DataLayout DL,
+           ObjectCache *Cache = nullptr)
+      : ES(std::move(ES)), DL(std::move(DL)), Mangle(*this->ES, this->DL),
+        TargetID(JTMB.getTargetTriple().str() + "/" + JTMB.getCPU() + "/" +
+                 JTMB.getFeatures().getString()),
+        ObjectJTMB(JTMB), LCTMgr(std::move(LCTMgr)),
+        StubsMgr(
+            createLocalIndirectStubsManagerBuilder(JTMB.getTargetTriple())()),
+        ObjectLayer(*this->ES,
+                    []() { return std::make_unique<SectionMemoryManager>(); }),
+        CompileLayer(*this->ES, ObjectLayer,
+                     std::make_unique<ConcurrentIRCompiler>(JTMB, Cache)),
+        OptimizeLayer(*this->ES, CompileLayer),
+        CODLayer(*this->ES, OptimizeLayer, *this->LCTMgr,
+                 createLocalIndirectStubsManagerBuilder(JTMB.getTargetTriple())),
+        MainJD(this->ES->createBareJITDylib("<main>")) {
+    // Let JIT'd code call back into anything exported by the host process.
+    MainJD.addGenerator(
+        cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(
+            DL.getGlobalPrefix())));
+    if (JTMB.getTargetTriple().isOSBinFormatCOFF()) {
+      ObjectLayer.setOverrideObjectFlagsWithResponsibilityFlags(true);
+      ObjectLayer.setAutoClaimResponsibilityForObjectSymbols(true);
+    }
+  }
+
+  ~IsereJIT() {
+    if (auto Err = ES->endSession())
+      ES->reportError(std::move(Err));
+  }
+
+  /// Create - Build a JIT for the host process. Configure, if given, can
+  /// adjust the target (CPU, features, options) code is generated for.
+  static Expected<std::unique_ptr<IsereJIT>>
+  Create(ObjectCache *Cache = nullptr,
+         function_ref<void(JITTargetMachineBuilder &)> Configure = nullptr) {
+    auto EPC = SelfExecutorProcessControl::Create();
+    if (!EPC)
+      return EPC.takeError();
+
+    auto ES = std::make_unique<ExecutionSession>(std::move(*EPC));
+
+    const Triple &TT = ES->getExecutorProcessControl().getTargetTriple();
+    JITTargetMachineBuilder JTMB(TT);
+    if (Configure)
+      Configure(JTMB);
+
+    auto DL = JTMB.getDefaultDataLayoutForTarget();
+    if (!DL)
+      return DL.takeError();
+
+    // A call into a lazy function that fails to compile lands in
+    // handleLazyCompileFailure; the failure itself is reported through the
+    // session.
+#if LLVM_VERSION_MAJOR >= 17
+    auto ErrorHandler = ExecutorAddr::fromPtr(&handleLazyCompileFailure);
+#else
+    auto ErrorHandler = pointerToJITTargetAddress(&handleLazyCompileFailure);
+#endif
+    auto LCTMgr = createLocalLazyCallThroughManager(TT, *ES, ErrorHandler);
+    if (!LCTMgr)
+      return LCTMgr.takeError();
+
+    return std::make_unique<IsereJIT>(std::move(ES), std::move(*LCTMgr),
+                                      std::move(JTMB), std::move(*DL), Cache);
+  }
+
+  const DataLayout &getDataLayout() const { return DL; }
+
+  JITDylib &getMainJITDylib() { return MainJD; }
+
+  /// getTargetID - Identifies the code this JIT generates, for keying caches
+  /// of compiled objects.
+  StringRef getTargetID() const { return TargetID; }
+
+  /// addModule - Hand a module over to the JIT. If RT is given, the module's
+  /// code is owned by that tracker and is freed when the tracker is removed.
+  Error addModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr) {
+    if (!RT)
+      RT = MainJD.getDefaultResourceTracker();
+    return CompileLayer.add(RT, std::move(TSM));
+  }
+
+  /// addLazyModule - Like addModule, but only compile each of the module's
+  /// functions when it is first called. The module's IR passes through the
+  /// optimizer transform (see setOptimizer) just before it is compiled.
+  Error addLazyModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr) {
+    if (!RT)
+      RT = MainJD.getDefaultResourceTracker();
+    return CODLayer.add(RT, std::move(TSM));
+  }
+
+  /// setOptimizer - Install the transform addLazyModule's IR goes through on
+  /// its way to the backend. Eagerly added modules are expected to have been
+  /// optimized already.
+  void setOptimizer(IRTransformLayer::TransformFunction Optimize) {
+    OptimizeLayer.setTransform(std::move(Optimize));
+  }
+
+  /// compileModule - Compile M to an object exactly as addModule would, but
+  /// hand the object back instead of linking it, so that the caller can keep
+  /// a copy before passing it to addObjectFile.
+  Expected<std::unique_ptr<MemoryBuffer>> compileModule(Module &M) {
+    if (!ObjectTM) {
+      auto TM = ObjectJTMB.createTargetMachine();
+      if (!TM)
+        return TM.takeError();
+      ObjectTM = std::move(*TM);
+    }
+    return SimpleCompiler(*ObjectTM)(M);
+  }
+
+  /// addObjectFile - Link an already compiled object, such as one taken from
+  /// an object cache, into the JIT.
+  Error addObjectFile(std::unique_ptr<MemoryBuffer> Obj,
+                      ResourceTrackerSP RT = nullptr) {
+    if (!RT)
+      RT = MainJD.getDefaultResourceTracker();
+    return ObjectLayer.add(RT, std::move(Obj));
+  }
+
+  /// redirect - Make calls to Name run ImplName's code from now on. The first
+  /// redirect of a name defines it in the main dylib as a stub that jumps
+  /// through a pointer; later ones just repoint the stub, in a single store,
+  /// so code already compiled against Name (and calls to it in flight) keep
+  /// working. The code Name used to run is not freed.
+  Error redirect(StringRef Name, StringRef ImplName) {
+    if (!StubsMgr)
+      return make_error<StringError>("redefinition is not supported on " +
+                                         TargetID,
+                                     inconvertibleErrorCode());
+    auto Impl = lookup(ImplName);
+    if (!Impl)
+      return Impl.takeError();
+#if LLVM_VERSION_MAJOR >= 17
+    ExecutorAddr Target = *Impl;
+#else
+    JITTargetAddress Target = Impl->getValue();
+#endif
+    if (StubsMgr->findStub(Name, /*ExportedStubsOnly=*/true).getAddress())
+      return StubsMgr->updatePointer(Name, Target);
+
+    if (auto Err = StubsMgr->createStub(
+            Name, Target, JITSymbolFlags::Exported | JITSymbolFlags::Callable))
+      return Err;
+    auto Stub = StubsMgr->findStub(Name, /*ExportedStubsOnly=*/true);
+    return MainJD.define(absoluteSymbols({{Mangle(Name.str()), Stub}}));
+  }
+
+  /// lookup - Compile (if needed) and return the address of the named symbol.
+  Expected<ExecutorAddr> lookup(StringRef Name) {
+    auto Sym = ES->lookup({&MainJD}, Mangle(Name.str()));
+    if (!Sym)
+      return Sym.takeError();
+#if LLVM_VERSION_MAJOR >= 17
+    return Sym->getAddress();
+#else
+    return ExecutorAddr(Sym->getAddress());
+#endif
+  }
+
+  /// recordArity - Note that FnName, once in the JIT, takes Arity doubles.
+  void recordArity(StringRef FnName, size_t Arity) {
+    std::lock_guard<std::mutex> Lock(ArityMutex);
+    Arities[FnName] = Arity;
+  }
+
+  /// runBatchKernel - Evaluate FnName over N rows of columnar input by calling
+  /// its FnName_batch kernel (see -batch-kernels). Columns[i] must hold N
+  /// values of the function's i-th argument, so there must be one column per
+  /// argument (see recordArity); Out receives N results. The buffers are read
+  /// and written in place, nothing is copied.
+  Error runBatchKernel(StringRef FnName, ArrayRef<const double *> Columns,
+                       double *Out, size_t N) {
+    if (auto Err = checkColumns(FnName, Columns))
+      return Err;
+    auto Kernel = lookup((FnName + "_batch").str());
+    if (!Kernel)
+      return Kernel.takeError();
+    withArity(Columns.size(), [&](auto Seq) {
+      callKernelWith(*Kernel, Columns, Out, 0, N, Seq);
+    });
+    return Error::success();
+  }
+
+  /// evaluateParallel - Like runBatchKernel, but split the N rows into chunks
+  /// of ChunkRows and spread them over Pool. Each chunk calls FnName_batch if
+  /// the function has a batch kernel, and otherwise calls the scalar FnName
+  /// once per row.
+  Error evaluateParallel(StringRef FnName, ArrayRef<const double *> Columns,
+                         double *Out, size_t N, WorkStealingPool &Pool,
+                         size_t ChunkRows = 4096) {
+    if (auto Err = checkColumns(FnName, Columns))
+      return Err;
+
+    ExecutorAddr Fn;
+    bool IsBatch = true;
+    if (auto Kernel = lookup((FnName + "_batch").str())) {
+      Fn = *Kernel;
+    } else {
+      consumeError(Kernel.takeError());
+      auto Scalar = lookup(FnName);
+      if (!Scalar)
+        return Scalar.takeError();
+      Fn = *Scalar;
+      IsBatch = false;
+    }
+
+    withArity(Columns.size(), [&](auto Seq) {
+      Pool.parallelFor(N, ChunkRows, [&](size_t Begin, size_t End) {
+        if (IsBatch)
+          callKernelWith(Fn, Columns, Out, Begin, End, Seq);
+        else
+          callScalarWith(Fn, Columns, Out, Begin, End, Seq);
+      });
+    });
+    return Error::success();
+  }
+
+private:
+  /// handleLazyCompileFailure - Where a call goes when the lazy function it
+  /// calls could not be compiled. There is no code to return to, so stop.
+  static void handleLazyCompileFailure() {
+    report_fatal_error("a lazily compiled function failed to compile",
+                       /*gen_crash_diag=*/false);
+  }
+
+  template <size_t> using ColumnPtr = const double *;
+  template <size_t> using ColumnValue = double;
+
+  /// checkColumns - Whether there is one column per argument of FnName.
+  Error checkColumns(StringRef FnName, ArrayRef<const double *> Columns) {
+    if (Columns.size() > MaxBatchColumns)
+      return make_error<StringError>("batch kernels take at most " +
+                                         std::to_string(MaxBatchColumns) +
+                                         " columns",
+                                     inconvertibleErrorCode());
+    std::lock_guard<std::mutex> Lock(ArityMutex);
+    auto It = Arities.find(FnName);
+    if (It == Arities.end())
+      return make_error<StringError>("no function named '" + FnName + "'",
+                                     inconvertibleErrorCode());
+    if (It->second == Columns.size())
+      return Error::success();
+    return make_error<StringError>(
+        "'" + FnName + "' takes " + std::to_string(It->second) +
+            " arguments, but " + std::to_string(Columns.size()) +
+            " columns were given",
+        inconvertibleErrorCode());
+  }
+
+  /// withArity - Call Fn with std::make_index_sequence<Arity>() for a runtime
+  /// Arity of at most MaxBatchColumns, so callers can expand one argument per
+  /// column.
+  template <typename FnT> static void withArity(size_t Arity, FnT &&Fn) {
+    withArityImpl(Arity, Fn, std::make_index_sequence<MaxBatchColumns + 1>());
+  }
+
+  template <typename FnT, size_t... A>
+  static void withArityImpl(size_t Arity, FnT &Fn, std::index_sequence<A...>) {
+    ((Arity == A ? (Fn(std::make_index_sequence<A>()), true) : false) || ...);
+  }
+
+  template <size_t... I>
+  static void callKernelWith(ExecutorAddr Kernel,
+                             [[maybe_unused]] ArrayRef<const double *> Columns,
+                             double *Out, size_t Begin, size_t End,
+                             std::index_sequence<I...>) {
+    using KernelFn = void (*)(ColumnPtr<I>..., double *, size_t);
+    Kernel.toPtr<KernelFn>()((Columns[I] + Begin)..., Out + Begin,
+                             End - Begin);
+  }
+
+  template <size_t... I>
+  static void callScalarWith(ExecutorAddr Scalar,
+                             [[maybe_unused]] ArrayRef<const double *> Columns,
+                             double *Out, size_t Begin, size_t End,
+                             std::index_sequence<I...>) {
+    using ScalarFn = double (*)(ColumnValue<I>...);
+    auto *F = Scalar.toPtr<ScalarFn>();
+    for (size_t Row = Begin; Row != End; ++Row)
+      Out[Row] = F(Columns[I][Row]...);
+  }
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif // ISERE_JIT_H
@@ -0,0 +1,170 @@
+//===- WorkStealingPool.h - Work-stealing parallel-for ----------*- C++ -*-===//
+//
+// A fixed pool of threads for running data-parallel loops over JIT'd code.
+// parallelFor splits an index range into chunks and deals contiguous runs of
+// chunks to per-thread queues. A thread works through its own queue from the
+// front and, once that is empty, steals from the back of the others, so
+// uneven chunks still keep every core busy.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef ISERE_WORKSTEALINGPOOL_H
+#define ISERE_WORKSTEALINGPOOL_H
+
+#include "llvm/ADT/STLFunctionalExtras.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace llvm {
+namespace orc {
+
+class WorkStealingPool {
+  using Range = std::pair<size_t, size_t>;
+
+  struct Queue {
+    std::mutex M;
+    std::deque<Range> Ranges;
+  };
+
+  std::vector<std::thread> Threads;
+
+  /// Queues - One per pool thread, plus a last one for the thread that calls
+  /// parallelFor, which works alongside the pool.
+  std::vector<std::unique_ptr<Queue>> Queues;
+
+  /// JobMutex - Serializes parallelFor calls; one loop runs at a time.
+  std::mutex JobMutex;
+
+  std::mutex StateMutex;
+  std::condition_variable WorkAvailable, JobDone;
+  uint64_t Generation = 0;
+  bool ShuttingDown = false;
+
+  /// Body/Pending - The loop being run and how many of its chunks have not
+  /// finished yet. Both are set before any chunk is queued.
+  function_ref<void(size_t, size_t)> Body;
+  std::atomic<size_t> Pending{0};
+
+  bool popOrSteal(unsigned Self, Range &R) {
+    {
+      Queue &Own = *Queues[Self];
+      std::lock_guard<std::mutex> Lock(Own.M);
+      if (!Own.Ranges.empty()) {
+        R = Own.Ranges.front();
+        Own.Ranges.pop_front();
+        return true;
+      }
+    }
+    for (unsigned I = 1, E = Queues.size(); I != E; ++I) {
+      Queue &Victim = *Queues[(Self + I) % E];
+      std::lock_guard<std::mutex> Lock(Victim.M);
+      if (!Victim.Ranges.empty()) {
+        R = Victim.Ranges.back();
+        Victim.Ranges.pop_back();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void runChunks(unsigned Self) {
+    Range R;
+    while (popOrSteal(Self, R)) {
+      Body(R.first, R.second);
+      if (--Pending == 0) {
+        std::lock_guard<std::mutex> Lock(StateMutex);
+        JobDone.notify_all();
+      }
+    }
+  }
+
+  void workerLoop(unsigned Self) {
+    uint64_t Seen = 0;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> Lock(StateMutex);
+        WorkAvailable.wait(
+            Lock, [&] { return ShuttingDown || Generation != Seen; });
+        if (ShuttingDown)
+          return;
+        Seen = Generation;
+      }
+      runChunks(Self);
+    }
+  }
+
+public:
+  /// WorkStealingPool - Start NumThreads threads (default: one per hardware
+  /// thread, counting the caller of parallelFor).
+  explicit WorkStealingPool(unsigned NumThreads = 0) {
+    if (!NumThreads)
+      NumThreads = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned I = 0; I != NumThreads; ++I)
+      Queues.push_back(std::make_unique<Queue>());
+    for (unsigned I = 0; I + 1 < NumThreads; ++I)
+      Threads.emplace_back([this, I] { workerLoop(I); });
+  }
+
+  ~WorkStealingPool() {
+    {
+      std::lock_guard<std::mutex> Lock(StateMutex);
+      ShuttingDown = true;
+    }
+    WorkAvailable.notify_all();
+    for (auto &T : Threads)
+      T.join();
+  }
+
+  WorkStealingPool(const WorkStealingPool &) = delete;
+  WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+
+  /// getNumThreads - The number of threads working on each loop, including
+  /// the caller.
+  unsigned getNumThreads() const { return Queues.size(); }
+
+  /// parallelFor - Call Fn(Begin, End) over disjoint chunks of at most Grain
+  /// indices covering [0, N), and return once every chunk has run.
+  void parallelFor(size_t N, size_t Grain,
+                   function_ref<void(size_t, size_t)> Fn) {
+    if (N == 0)
+      return;
+    std::lock_guard<std::mutex> Job(JobMutex);
+
+    Grain = std::max<size_t>(Grain, 1);
+    size_t NumChunks = (N + Grain - 1) / Grain;
+    size_t PerQueue = (NumChunks + Queues.size() - 1) / Queues.size();
+
+    Body = Fn;
+    Pending = NumChunks;
+    for (size_t C = 0; C != NumChunks; ++C) {
+      Queue &Q = *Queues[C / PerQueue];
+      std::lock_guard<std::mutex> Lock(Q.M);
+      Q.Ranges.push_back({C * Grain, std::min(N, (C + 1) * Grain)});
+    }
+
+    {
+      std::lock_guard<std::mutex> Lock(StateMutex);
+      ++Generation;
+    }
+    WorkAvailable.notify_all();
+
+    runChunks(Queues.size() - 1);
+
+    std::unique_lock<std::mutex> Lock(StateMutex);
+    JobDone.wait(Lock, [&] { return Pending == 0; });
+  }
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif // ISERE_WORKSTEALINGPOOL_H
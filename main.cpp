@@ -1,27 +1,439 @@
+#include "DiskObjectCache.h"
+#include "IsereJIT.h"
 #include "llvm/ADT/APFloat.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/ScopeExit.h"
+#include "llvm/ADT/ScopedHashTable.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/StringSwitch.h"
+#include "llvm/Analysis/CGSCCPassManager.h"
+#include "llvm/Analysis/InlineCost.h"
+#include "llvm/Analysis/LoopAnalysisManager.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/VectorUtils.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Config/llvm-config.h"
 #include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/CFG.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Metadata.h"
 #include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Value.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/Casting.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Errno.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/StringSaver.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Support/TargetSelect.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+#if LLVM_VERSION_MAJOR >= 17
+#include "llvm/TargetParser/Host.h"
+#include "llvm/TargetParser/SubtargetFeature.h"
+#else
+#include "llvm/MC/SubtargetFeature.h"
+#include "llvm/Support/Host.h"
+#endif
+#include "llvm/Transforms/IPO/ElimAvailExtern.h"
+#include "llvm/Transforms/IPO/GlobalDCE.h"
+#include "llvm/Transforms/IPO/Inliner.h"
+#include "llvm/Transforms/IPO/SCCP.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Scalar/EarlyCSE.h"
+#include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Scalar/IndVarSimplify.h"
+#include "llvm/Transforms/Scalar/LoopDeletion.h"
+#include "llvm/Transforms/Scalar/LoopPassManager.h"
+#include "llvm/Transforms/Scalar/LoopUnrollPass.h"
+#include "llvm/Transforms/Scalar/Reassociate.h"
+#include "llvm/Transforms/Scalar/SimplifyCFG.h"
+#include "llvm/Transforms/Scalar/TailRecursionElimination.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/Mem2Reg.h"
+#include "llvm/Transforms/Vectorize/LoopVectorize.h"
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <cctype>
+#include <chrono>
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
+#include <ctime>
+#include <functional>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
+#include <thread>
+#include <type_traits>
 #include <vector>
+#ifndef _WIN32
+#include <poll.h>
+#include <unistd.h>
+#endif
 
 using namespace llvm;
 
+//===----------------------------------------------------------------------===//
+// Compile-time instrumentation (-ftime-report, -ftime-trace)
+//===----------------------------------------------------------------------===//
+
+static cl::opt<bool>
+    TimeReport("ftime-report",
+               cl::desc("Print wall and CPU time spent in each compilation "
+                        "phase and on each kind of top-level item"));
+
+static cl::opt<std::string>
+    TimeTraceFile("ftime-trace",
+                  cl::desc("Write a Chrome trace-event JSON file of the "
+                           "compilation phases"),
+                  cl::value_desc("filename"));
+
+static cl::opt<unsigned> TimeTraceGranularity(
+    "ftime-trace-granularity",
+    cl::desc("Minimum duration, in microseconds, of a traced event"),
+    cl::init(500));
+
+namespace {
+
+/// Phase - The mutually exclusive compilation phases -ftime-report tracks.
+enum Phase {
+  PhaseLex,
+  PhaseParse,
+  PhaseCodegen,
+  PhaseVerify,
+  PhaseOptimize,
+  PhaseJIT,
+  PhaseExecute,
+  PhaseEmit,
+  NumPhases
+};
+
+/// ItemKind - The kinds of top-level item -ftime-report tracks.
+enum ItemKind { ItemDefinition, ItemImport, ItemTopLevelExpr, NumItemKinds };
+
+/// CompileTimers - The timers of one compilation thread. Timers must not be
+/// shared between threads, so every batch worker gets its own set.
+struct CompileTimers {
+  TimerGroup PhaseGroup{"isere-phases", "Isere compilation phases"};
+  TimerGroup ItemGroup{"isere-items", "Isere top-level items"};
+  Timer Phases[NumPhases];
+  Timer Items[NumItemKinds];
+
+  /// Active - The phase currently being timed, if any.
+  Timer *Active = nullptr;
+
+  CompileTimers() {
+    static const char *const PhaseNames[NumPhases][2] = {
+        {"lex", "Lexing"},
+        {"parse", "Parsing"},
+        {"codegen", "IR generation"},
+        {"verify", "IR verification"},
+        {"optimize", "Optimization"},
+        {"jit", "JIT compilation and linking"},
+        {"execute", "Execution"},
+        {"emit", "Object/bitcode emission"}};
+    static const char *const ItemNames[NumItemKinds][2] = {
+        {"definition", "Function definitions"},
+        {"import", "Imports"},
+        {"toplevel", "Top-level expressions"}};
+    for (unsigned I = 0; I != NumPhases; ++I)
+      Phases[I].init(PhaseNames[I][0], PhaseNames[I][1], PhaseGroup);
+    for (unsigned I = 0; I != NumItemKinds; ++I)
+      Items[I].init(ItemNames[I][0], ItemNames[I][1], ItemGroup);
+  }
+};
+
+} // end of anonymous namespace
+
+static thread_local std::unique_ptr<CompileTimers> ThreadTimers;
+
+static CompileTimers &getThreadTimers() {
+  if (!ThreadTimers)
+    ThreadTimers = std::make_unique<CompileTimers>();
+  return *ThreadTimers;
+}
+
+namespace {
+
+/// TimePhase - Attribute the enclosing region to phase Ph. Phases nest but do
+/// not overlap in the report: the enclosing phase is paused for the duration,
+/// so the per-phase times add up to the total. Every phase except lexing is
+/// also recorded as a -ftime-trace event.
+class TimePhase {
+  Timer *T = nullptr;
+  Timer *Prev = nullptr;
+  std::optional<TimeTraceScope> Trace;
+
+public:
+  TimePhase(Phase Ph, StringRef Detail = "") {
+    if (Ph != PhaseLex && timeTraceProfilerEnabled()) {
+      static const char *const TraceNames[NumPhases] = {
+          "Lex",      "Parse", "Codegen", "Verify",
+          "Optimize", "JIT",   "Execute", "Emit"};
+      Trace.emplace(TraceNames[Ph], Detail);
+    }
+    if (!TimeReport)
+      return;
+    CompileTimers &CT = getThreadTimers();
+    T = &CT.Phases[Ph];
+    Prev = CT.Active;
+    if (Prev)
+      Prev->stopTimer();
+    T->startTimer();
+    CT.Active = T;
+  }
+
+  ~TimePhase() {
+    if (!T)
+      return;
+    T->stopTimer();
+    if (Prev)
+      Prev->startTimer();
+    getThreadTimers().Active = Prev;
+  }
+};
+
+/// TimeItem - Time the enclosing region as one top-level item of kind K.
+class TimeItem {
+  std::optional<TimeRegion> Region;
+  TimeTraceScope Trace;
+
+public:
+  TimeItem(ItemKind K)
+      : Trace(K == ItemDefinition ? "Definition"
+              : K == ItemImport   ? "Import"
+                                  : "TopLevelExpr") {
+    if (TimeReport)
+      Region.emplace(getThreadTimers().Items[K]);
+  }
+};
+
+} // end of anonymous namespace
+
+/// printTimeReport - Print and reset this thread's -ftime-report timers.
+static void printTimeReport() {
+  if (!TimeReport || !ThreadTimers)
+    return;
+  static std::mutex ReportMutex;
+  std::lock_guard<std::mutex> Lock(ReportMutex);
+  ThreadTimers->PhaseGroup.print(errs(), /*ResetAfterPrint=*/true);
+  ThreadTimers->ItemGroup.print(errs(), /*ResetAfterPrint=*/true);
+}
+
+//===----------------------------------------------------------------------===//
+// Runtime instrumentation (-function-stats)
+//===----------------------------------------------------------------------===//
+
+enum class StatsFormat { None, JSON, Prometheus };
+
+static cl::opt<StatsFormat> FunctionStatsFormat(
+    "function-stats",
+    cl::desc("Count the calls of, and the cycles spent in, each JIT'd "
+             "function, and print them at exit and on dumpstats():"),
+    cl::values(clEnumValN(StatsFormat::JSON, "json", "As a JSON object"),
+               clEnumValN(StatsFormat::Prometheus, "prometheus",
+                          "In the Prometheus text exposition format")),
+    cl::init(StatsFormat::None));
+
+static cl::opt<std::string> FunctionStatsOutput(
+    "function-stats-output",
+    cl::desc("File -function-stats writes to, replacing it on every dump "
+             "(default: stderr)"),
+    cl::value_desc("filename"), cl::init("-"));
+
+namespace {
+
+/// FunctionStats - What the code of one function adds up as it runs. Cycles
+/// are timestamp-counter ticks from entry to return, callees included, so a
+/// recursive function counts its nested calls again.
+struct FunctionStats {
+  uint64_t Calls = 0;
+  uint64_t Cycles = 0;
+};
+
+} // end of anonymous namespace
+
+/// FunctionStatsTable - The stats of every instrumented function by source
+/// name, so that redefinitions and recompilations add to the same entry.
+/// Entries never move or go away, as JIT'd code holds their addresses.
+static StringMap<FunctionStats> FunctionStatsTable;
+static std::mutex FunctionStatsMutex;
+
+/// getCounterAddress - The address of Counter as an IR constant.
+static Constant *getCounterAddress(LLVMContext &Ctx, uint64_t *Counter) {
+  Type *I64 = Type::getInt64Ty(Ctx);
+  return ConstantExpr::getIntToPtr(
+      ConstantInt::get(I64, reinterpret_cast<uintptr_t>(Counter)),
+      PointerType::getUnqual(I64));
+}
+
+/// addToCounter - Emit the addition of Amount to the counter at Addr. The
+/// update is a plain load and store rather than an atomic: a lost update
+/// between threads only blurs the numbers, while contended atomics would
+/// serialize parallel kernels.
+static void addToCounter(IRBuilder<> &B, Value *Addr, Value *Amount) {
+  Value *Count = B.CreateLoad(B.getInt64Ty(), Addr, "prof.count");
+  B.CreateStore(B.CreateAdd(Count, Amount), Addr);
+}
+
+/// instrumentFunctionStats - Make F, the code of function Name, count its
+/// calls and time them with the cycle counter.
+static void instrumentFunctionStats(Function &F, StringRef Name) {
+  FunctionStats *Stats;
+  {
+    std::lock_guard<std::mutex> Lock(FunctionStatsMutex);
+    Stats = &FunctionStatsTable[Name];
+  }
+  LLVMContext &Ctx = F.getContext();
+  Function *ReadCycles =
+      Intrinsic::getDeclaration(F.getParent(), Intrinsic::readcyclecounter);
+  Constant *Cycles = getCounterAddress(Ctx, &Stats->Cycles);
+
+  IRBuilder<> B(&*F.getEntryBlock().getFirstInsertionPt());
+  addToCounter(B, getCounterAddress(Ctx, &Stats->Calls), B.getInt64(1));
+  Value *Start = B.CreateCall(ReadCycles, {}, "stats.start");
+
+  SmallVector<ReturnInst *, 4> Rets;
+  for (auto &BB : F)
+    if (auto *Ret = dyn_cast<ReturnInst>(BB.getTerminator()))
+      Rets.push_back(Ret);
+  for (ReturnInst *Ret : Rets) {
+    // Nothing may come between a musttail call and its return, so stop the
+    // clock before the call; the callee counts itself.
+    Instruction *Exit = Ret;
+    if (auto *CI = dyn_cast_or_null<CallInst>(Ret->getPrevNode()))
+      if (CI->isMustTailCall())
+        Exit = CI;
+    B.SetInsertPoint(Exit);
+    Value *End = B.CreateCall(ReadCycles, {}, "stats.end");
+    addToCounter(B, Cycles, B.CreateSub(End, Start, "stats.cycles"));
+  }
+}
+
+/// escapePrometheusLabel - Escape S for use as a Prometheus label value.
+static std::string escapePrometheusLabel(StringRef S) {
+  std::string Escaped;
+  for (char C : S) {
+    if (C == '\\' || C == '"')
+      Escaped += '\\';
+    if (C == '\n')
+      Escaped += "\\n";
+    else
+      Escaped += C;
+  }
+  return Escaped;
+}
+
+/// writeFunctionStats - Write the stats table to OS in the -function-stats
+/// format, busiest function first.
+static void writeFunctionStats(raw_ostream &OS) {
+  std::vector<std::pair<std::string, FunctionStats>> Entries;
+  {
+    std::lock_guard<std::mutex> Lock(FunctionStatsMutex);
+    for (auto &Entry : FunctionStatsTable)
+      Entries.push_back({Entry.first().str(), Entry.second});
+  }
+  llvm::sort(Entries, [](const auto &L, const auto &R) {
+    if (L.second.Cycles != R.second.Cycles)
+      return L.second.Cycles > R.second.Cycles;
+    return L.first < R.first;
+  });
+
+  if (FunctionStatsFormat == StatsFormat::JSON) {
+    json::Array Functions;
+    for (auto &E : Entries)
+      Functions.push_back(json::Object{{"name", E.first},
+                                       {"calls", int64_t(E.second.Calls)},
+                                       {"cycles", int64_t(E.second.Cycles)}});
+    OS << formatv("{0:2}", json::Value(json::Object{
+                               {"functions", std::move(Functions)}}))
+       << "\n";
+    return;
+  }
+
+  OS << "# HELP isere_function_calls_total Calls of each JIT'd function.\n"
+     << "# TYPE isere_function_calls_total counter\n";
+  for (auto &E : Entries)
+    OS << "isere_function_calls_total{function=\""
+       << escapePrometheusLabel(E.first) << "\"} " << E.second.Calls << "\n";
+  OS << "# HELP isere_function_cycles_total Cycle counter ticks spent in each "
+        "JIT'd function, callees included.\n"
+     << "# TYPE isere_function_cycles_total counter\n";
+  for (auto &E : Entries)
+    OS << "isere_function_cycles_total{function=\""
+       << escapePrometheusLabel(E.first) << "\"} " << E.second.Cycles << "\n";
+}
+
+/// dumpFunctionStats - Write the stats table to -function-stats-output.
+static void dumpFunctionStats() {
+  if (FunctionStatsFormat == StatsFormat::None)
+    return;
+  const std::string &Path = FunctionStatsOutput;
+  if (Path == "-") {
+    writeFunctionStats(errs());
+    return;
+  }
+
+  // Write to a temporary and rename it into place, so that a scraper never
+  // sees a partial table.
+  SmallString<256> TmpPath;
+  int FD;
+  std::error_code EC =
+      sys::fs::createUniqueFile(Path + ".%%%%%%.tmp", FD, TmpPath);
+  if (EC) {
+    errs() << "warning: could not write function stats to '" << Path
+           << "': " << EC.message() << "\n";
+    return;
+  }
+  {
+    raw_fd_ostream OS(FD, /*shouldClose=*/true);
+    writeFunctionStats(OS);
+    OS.close();
+    EC = OS.error();
+    OS.clear_error();
+  }
+  if (!EC)
+    EC = sys::fs::rename(TmpPath, Path);
+  if (EC) {
+    errs() << "warning: could not write function stats to '" << Path
+           << "': " << EC.message() << "\n";
+    sys::fs::remove(TmpPath);
+  }
+}
+
 //===----------------------------------------------------------------------===//
 // Token Definitions (Lexer)                                               ===//
 //===----------------------------------------------------------------------===//
@@ -35,52 +447,233 @@ enum Token {
 
   // primary
   tok_identifier = -4,
-  tok_number = -5
+  tok_number = -5,
+
+  // operators
+  tok_binary = -6,
+
+  // control
+  tok_if = -7,
+  tok_then = -8,
+  tok_else = -9,
+  tok_for = -10,
+  tok_in = -11,
+
+  // var definition
+  tok_var = -12,
+
+  // a byte outside the ASCII range, which no token may contain
+  tok_invalid = -13
+};
+
+/// OperatorToken - Two-character operators. They are lexed to codes past the
+/// ASCII range, so that like every other operator each is a single character
+/// indexing the OperatorTable. Source bytes in that range never reach the
+/// parser as themselves (see tok_invalid).
+enum OperatorToken {
+  op_le = 0x80, // <=
+  op_ge = 0x81, // >=
+  op_eq = 0x82  // ==
+};
+
+namespace {
+
+/// SourceLocation - A line and column in a source unit, both 1-based.
+struct SourceLocation {
+  unsigned Line = 1;
+  unsigned Col = 0;
+};
+
+/// Lexer - Turns a source unit into tokens. All scanning state lives in the
+/// object, so independent source units can be lexed concurrently.
+///
+/// When compiling a file, the whole input is read (or mapped) into memory up
+/// front and scanned in place: CurPtr is the next unread character and
+/// identifiers are handed out as slices of the buffer. Without a buffer the
+/// lexer falls back to reading standard input a character at a time, which is
+/// what the interactive REPL uses.
+class Lexer {
+  std::unique_ptr<MemoryBuffer> SourceBuffer;
+  const char *CurPtr = nullptr;
+  const char *BufferEnd = nullptr;
+
+  StringRef IdentifierStr; // Filled in if tok_identifier
+  double NumVal = 0;       // Filled in if tok_number
+  int LastChar = ' ';
+
+  /// IdentifierBuf - Backing storage for IdentifierStr when reading stdin.
+  std::string IdentifierBuf;
+
+  /// CharLoc/TokLoc - Where LastChar and the last token returned are.
+  SourceLocation CharLoc, TokLoc;
+
+  /// IdleHandler - See setIdleHandler. While it is set, standard input is
+  /// read through StdinBuf rather than stdio, so that the lexer knows when a
+  /// read would block.
+  std::function<int()> IdleHandler;
+  char StdinBuf[4096];
+  size_t StdinPos = 0, StdinLen = 0;
+  int readStdin();
+
+  /// getNextChar - Return the next input character, or EOF.
+  int getNextChar() {
+    int C;
+    if (!SourceBuffer)
+      C = IdleHandler ? readStdin() : getchar();
+    else if (CurPtr == BufferEnd)
+      C = EOF;
+    else
+      C = (unsigned char)*CurPtr++;
+    if (C == '\n') {
+      ++CharLoc.Line;
+      CharLoc.Col = 0;
+    } else {
+      ++CharLoc.Col;
+    }
+    return C;
+  }
+
+  /// isIdentifierChar/isNumberChar - Classify an in-buffer character.
+  bool isIdentifierChar(const char *P) const {
+    return P != BufferEnd && isalnum((unsigned char)*P);
+  }
+  bool isNumberChar(const char *P) const {
+    return P != BufferEnd && (isdigit((unsigned char)*P) || *P == '.');
+  }
+
+public:
+  /// Lexer - Read tokens interactively from standard input.
+  Lexer() = default;
+
+  /// Lexer - Scan the in-memory source unit Buf.
+  explicit Lexer(std::unique_ptr<MemoryBuffer> Buf)
+      : SourceBuffer(std::move(Buf)), CurPtr(SourceBuffer->getBufferStart()),
+        BufferEnd(SourceBuffer->getBufferEnd()) {}
+
+  /// isInteractive - True when reading from standard input.
+  bool isInteractive() const { return !SourceBuffer; }
+
+  /// getBufferName - The name diagnostics give the source unit.
+  StringRef getBufferName() const {
+    return SourceBuffer ? SourceBuffer->getBufferIdentifier() : "<stdin>";
+  }
+
+  /// getTokLoc - Where the last token returned starts.
+  SourceLocation getTokLoc() const { return TokLoc; }
+
+  /// setIdleHandler - Call Handler whenever reading standard input would
+  /// block. It returns how many milliseconds to wait for input before it is
+  /// called again, or -1 to wait for as long as it takes. Set it before the
+  /// first token is read.
+  void setIdleHandler(std::function<int()> Handler) {
+    IdleHandler = std::move(Handler);
+  }
+
+  StringRef getIdentifier() const { return IdentifierStr; }
+  double getNumVal() const { return NumVal; }
+
+  int getTok();
 };
 
-static std::string IdentifierStr; // Filled in if tok_identifier
-static double NumVal;             // Filled in if tok_number
+} // end of anonymous namespace
 
-/// getTok - Reads the next token from standard input.
-static int getTok() {
-  static int LastChar = ' ';
+/// readStdin - Read a character from standard input, first giving the idle
+/// handler its turn for as long as no input is available.
+int Lexer::readStdin() {
+  if (StdinPos == StdinLen) {
+#ifdef _WIN32
+    return getchar();
+#else
+    pollfd In = {STDIN_FILENO, POLLIN, 0};
+    for (int Timeout = IdleHandler(); Timeout >= 0;
+         Timeout = IdleHandler())
+      if (poll(&In, 1, Timeout) != 0)
+        break;
+    ssize_t N = sys::RetryAfterSignal(
+        -1, [&] { return ::read(STDIN_FILENO, StdinBuf, sizeof(StdinBuf)); });
+    if (N <= 0)
+      return EOF;
+    StdinPos = 0;
+    StdinLen = N;
+#endif
+  }
+  return (unsigned char)StdinBuf[StdinPos++];
+}
 
+/// getTok - Reads the next token from the source buffer or standard input.
+int Lexer::getTok() {
   // Skip any whitespace
   while (isspace(LastChar))
-    LastChar = getchar();
+    LastChar = getNextChar();
+  TokLoc = CharLoc;
 
   // Handle identifiers and keywords
   if (isalpha(LastChar)) {
-    IdentifierStr = LastChar;
-    while (isalnum((LastChar = getchar())))
-      IdentifierStr += LastChar;
+    if (SourceBuffer) {
+      // LastChar has already been consumed, so the identifier starts one
+      // character behind CurPtr.
+      const char *Start = CurPtr - 1;
+      while (isIdentifierChar(CurPtr))
+        ++CurPtr;
+      IdentifierStr = StringRef(Start, CurPtr - Start);
+      CharLoc.Col += CurPtr - Start - 1;
+      LastChar = getNextChar();
+    } else {
+      IdentifierBuf = LastChar;
+      while (isalnum((LastChar = getNextChar())))
+        IdentifierBuf += LastChar;
+      IdentifierStr = IdentifierBuf;
+    }
 
     if (IdentifierStr == "fn")
       return tok_fun;
     if (IdentifierStr == "import")
       return tok_imp;
+    if (IdentifierStr == "binary")
+      return tok_binary;
+    if (IdentifierStr == "if")
+      return tok_if;
+    if (IdentifierStr == "then")
+      return tok_then;
+    if (IdentifierStr == "else")
+      return tok_else;
+    if (IdentifierStr == "for")
+      return tok_for;
+    if (IdentifierStr == "in")
+      return tok_in;
+    if (IdentifierStr == "var")
+      return tok_var;
 
     return tok_identifier;
   }
 
   // Handle numbers
   if (isdigit(LastChar) || LastChar == '.') {
-    std::string NumStr;
-    do {
-      NumStr += LastChar;
-      LastChar = getchar();
-    } while (isdigit(LastChar) || LastChar == '.');
+    SmallString<32> NumStr;
+    if (SourceBuffer) {
+      const char *Start = CurPtr - 1;
+      while (isNumberChar(CurPtr))
+        ++CurPtr;
+      NumStr.assign(Start, CurPtr);
+      CharLoc.Col += CurPtr - Start - 1;
+      LastChar = getNextChar();
+    } else {
+      do {
+        NumStr += LastChar;
+        LastChar = getNextChar();
+      } while (isdigit(LastChar) || LastChar == '.');
+    }
     NumVal = strtod(NumStr.c_str(), 0);
     return tok_number;
   }
 
   // Handle comments
   if (LastChar == '/') {
-    LastChar = getchar();
+    LastChar = getNextChar();
     if (LastChar == '/') {
       // Single-line comment
       do
-        LastChar = getchar();
+        LastChar = getNextChar();
       while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
 
       if (LastChar != EOF)
@@ -88,18 +681,18 @@ static int getTok() {
     } else if (LastChar == '*') {
       // Multi-line comment
       while (true) {
-        LastChar = getchar();
+        LastChar = getNextChar();
         if (LastChar == EOF) {
           fprintf(stderr, "Error: Unterminated multi-line comment\n");
           return tok_eof;
         }
         if (LastChar == '*') {
-          LastChar = getchar();
+          LastChar = getNextChar();
           if (LastChar == '/')
             break;
         }
       }
-      LastChar = getchar();
+      LastChar = getNextChar();
       return getTok();
     } else {
       return '/';
@@ -110,9 +703,17 @@ static int getTok() {
   if (LastChar == EOF)
     return tok_eof;
 
-  // Otherwise, return the character as its ASCII value
+  // Otherwise, return the character as its ASCII value, or the code of the
+  // two-character operator it starts.
   int ThisChar = LastChar;
-  LastChar = getchar();
+  LastChar = getNextChar();
+  if (!isascii(ThisChar))
+    return tok_invalid;
+  if (LastChar == '=' && (ThisChar == '<' || ThisChar == '>' ||
+                          ThisChar == '=')) {
+    LastChar = getNextChar();
+    return ThisChar == '<' ? op_le : ThisChar == '>' ? op_ge : op_eq;
+  }
   return ThisChar;
 }
 
@@ -122,11 +723,43 @@ static int getTok() {
 
 namespace {
 
-/// ExprAST - Base class for all expression nodes.
+/// ExprAST - Base class for all expression nodes. Nodes are allocated from an
+/// ASTArena and are never destroyed individually, so the hierarchy keeps
+/// trivial destructors. There are no virtual functions either: codegen
+/// dispatches on the kind with a switch, which keeps nodes free of a vtable
+/// pointer and lets the kind share a word with the node's first fields.
 class ExprAST {
 public:
-  virtual ~ExprAST() = default;
-  virtual Value *codegen() = 0;
+  /// ExprKind - Discriminator for LLVM-style RTTI (isa/dyn_cast).
+  enum ExprKind : uint8_t {
+    EK_Number,
+    EK_Variable,
+    EK_Binary,
+    EK_Call,
+    EK_If,
+    EK_For,
+    EK_Var,
+    EK_Index
+  };
+
+private:
+  const ExprKind Kind;
+
+protected:
+  ExprAST(ExprKind Kind) : Kind(Kind) {}
+  ~ExprAST() = default;
+
+public:
+  ExprKind getKind() const { return Kind; }
+  Value *codegen();
+
+  /// codegenCond - Emit the expression as an i1 that is true when its value
+  /// is non-zero (a NaN counts as false), for use by a branch or select.
+  Value *codegenCond(const Twine &Name);
+
+protected:
+  /// codegenValueCond - codegenCond by comparing the value against 0.0.
+  Value *codegenValueCond(const Twine &Name);
 };
 
 /// NumberExprAST - Expression class for numeric literals like "1.0".
@@ -134,481 +767,3510 @@ class NumberExprAST : public ExprAST {
   double Val;
 
 public:
-  NumberExprAST(double Val) : Val(Val) {}
-  Value *codegen() override;
+  NumberExprAST(double Val) : ExprAST(EK_Number), Val(Val) {}
+  Value *codegen();
+  double getVal() const { return Val; }
+  static bool classof(const ExprAST *E) { return E->getKind() == EK_Number; }
 };
 
 /// VariableExprAST - Expression class for referencing a variable, like "a".
 class VariableExprAST : public ExprAST {
-  std::string Name;
+  StringRef Name;
 
 public:
-  VariableExprAST(const std::string &Name) : Name(Name) {}
-  Value *codegen() override;
+  VariableExprAST(StringRef Name) : ExprAST(EK_Variable), Name(Name) {}
+  Value *codegen();
+  StringRef getName() const { return Name; }
+  static bool classof(const ExprAST *E) { return E->getKind() == EK_Variable; }
 };
 
 /// BinaryExprAST - Expression class for a binary operator.
 class BinaryExprAST : public ExprAST {
-  char Op;
-  std::unique_ptr<ExprAST> LHS, RHS;
+  unsigned char Op;
+  ExprAST *LHS, *RHS;
 
 public:
-  BinaryExprAST(char Op, std::unique_ptr<ExprAST> LHS,
-                std::unique_ptr<ExprAST> RHS)
-      : Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
-  Value *codegen() override;
+  BinaryExprAST(unsigned char Op, ExprAST *LHS, ExprAST *RHS)
+      : ExprAST(EK_Binary), Op(Op), LHS(LHS), RHS(RHS) {}
+  Value *codegen();
+  Value *codegenCond(const Twine &Name);
+  unsigned char getOp() const { return Op; }
+  ExprAST *getLHS() const { return LHS; }
+  ExprAST *getRHS() const { return RHS; }
+  static bool classof(const ExprAST *E) { return E->getKind() == EK_Binary; }
 };
 
 /// CallExprAST - Expression class for function calls.
 class CallExprAST : public ExprAST {
-  std::string Callee;
-  std::vector<std::unique_ptr<ExprAST>> Args;
+  StringRef Callee;
+  ArrayRef<ExprAST *> Args;
+
+public:
+  CallExprAST(StringRef Callee, ArrayRef<ExprAST *> Args)
+      : ExprAST(EK_Call), Callee(Callee), Args(Args) {}
+  Value *codegen();
+  static bool classof(const ExprAST *E) { return E->getKind() == EK_Call; }
+};
+
+/// IfExprAST - Expression class for if/then/else.
+class IfExprAST : public ExprAST {
+  ExprAST *Cond, *Then, *Else;
+
+public:
+  IfExprAST(ExprAST *Cond, ExprAST *Then, ExprAST *Else)
+      : ExprAST(EK_If), Cond(Cond), Then(Then), Else(Else) {}
+  Value *codegen();
+  static bool classof(const ExprAST *E) { return E->getKind() == EK_If; }
+};
+
+/// ForExprAST - Expression class for for/in. The loop runs while End is
+/// non-zero, checking it before every iteration, and evaluates to 0.0.
+class ForExprAST : public ExprAST {
+  StringRef VarName;
+  ExprAST *Start, *End, *Step, *Body;
+
+public:
+  ForExprAST(StringRef VarName, ExprAST *Start, ExprAST *End, ExprAST *Step,
+             ExprAST *Body)
+      : ExprAST(EK_For), VarName(VarName), Start(Start), End(End), Step(Step),
+        Body(Body) {}
+  Value *codegen();
+  static bool classof(const ExprAST *E) { return E->getKind() == EK_For; }
+};
+
+/// VarExprAST - Expression class for var/in. Each initializer (or 0.0) is
+/// evaluated before its variable comes into scope, so it can refer to an
+/// outer variable of the same name.
+class VarExprAST : public ExprAST {
+public:
+  using VarBinding = std::pair<StringRef, ExprAST *>;
+
+private:
+  ArrayRef<VarBinding> VarNames;
+  ExprAST *Body;
+
+public:
+  VarExprAST(ArrayRef<VarBinding> VarNames, ExprAST *Body)
+      : ExprAST(EK_Var), VarNames(VarNames), Body(Body) {}
+  Value *codegen();
+  static bool classof(const ExprAST *E) { return E->getKind() == EK_Var; }
+};
+
+/// IndexExprAST - Expression class for an element of a buffer, like "p[i]".
+class IndexExprAST : public ExprAST {
+  ExprAST *Base, *Index;
 
 public:
-  CallExprAST(const std::string &Callee,
-              std::vector<std::unique_ptr<ExprAST>> Args)
-      : Callee(Callee), Args(std::move(Args)) {}
-  Value *codegen() override;
+  IndexExprAST(ExprAST *Base, ExprAST *Index)
+      : ExprAST(EK_Index), Base(Base), Index(Index) {}
+  Value *codegen();
+  /// codegenAddress - Emit the address of the element, for loads and stores.
+  Value *codegenAddress();
+  static bool classof(const ExprAST *E) { return E->getKind() == EK_Index; }
 };
 
+/// ValueType - The types of Isere values. Everything is a double unless a
+/// prototype says otherwise; a 'ptr' points at doubles, such as a buffer the
+/// host owns, and is read and written by indexing.
+enum class ValueType { Double, Ptr };
+
 /// PrototypeAST - Represents the "prototype" for a function.
 class PrototypeAST {
   std::string Name;
   std::vector<std::string> Args;
+  std::vector<ValueType> ArgTypes;
+  ValueType RetType;
+  bool Imported = false;
 
 public:
-  PrototypeAST(const std::string &Name, std::vector<std::string> Args)
-      : Name(Name), Args(std::move(Args)) {}
+  /// PrototypeAST - Without ArgTypes, every argument is a double.
+  PrototypeAST(const std::string &Name, std::vector<std::string> Args,
+               std::vector<ValueType> ArgTypes = {},
+               ValueType RetType = ValueType::Double)
+      : Name(Name), Args(std::move(Args)), ArgTypes(std::move(ArgTypes)),
+        RetType(RetType) {
+    this->ArgTypes.resize(this->Args.size(), ValueType::Double);
+  }
   Function *codegen();
   const std::string &getName() const { return Name; }
+  size_t getNumArgs() const { return Args.size(); }
+
+  /// hasSameSignature - Whether Other takes and returns the same types.
+  bool hasSameSignature(const PrototypeAST &Other) const {
+    return ArgTypes == Other.ArgTypes && RetType == Other.RetType;
+  }
+
+  /// isNumeric - Whether the function only takes and returns doubles.
+  bool isNumeric() const {
+    return RetType == ValueType::Double &&
+           llvm::all_of(ArgTypes,
+                        [](ValueType Ty) { return Ty == ValueType::Double; });
+  }
+
+  /// isImported - Whether this came from an import rather than a definition.
+  bool isImported() const { return Imported; }
+  void setImported() { Imported = true; }
+
+  /// hashSignature - Add the name and types of this prototype to Hash.
+  void hashSignature(MD5 &Hash) const {
+    Hash.update(Name);
+    Hash.update(ArrayRef<uint8_t>(uint8_t(RetType)));
+    for (ValueType Ty : ArgTypes)
+      Hash.update(ArrayRef<uint8_t>(uint8_t(Ty)));
+    Hash.update(ArrayRef<uint8_t>(uint8_t(0)));
+  }
 };
 
-/// FunctionAST - Represents a function definition.
+/// FunctionAST - Represents a function definition. The prototype is heap
+/// allocated because it outlives the body (see FunctionProtos); the body
+/// belongs to the parser's ASTArena.
 class FunctionAST {
   std::unique_ptr<PrototypeAST> Proto;
-  std::unique_ptr<ExprAST> Body;
+  ExprAST *Body;
 
 public:
-  FunctionAST(std::unique_ptr<PrototypeAST> Proto,
-              std::unique_ptr<ExprAST> Body)
-      : Proto(std::move(Proto)), Body(std::move(Body)) {}
+  FunctionAST(std::unique_ptr<PrototypeAST> Proto, ExprAST *Body)
+      : Proto(std::move(Proto)), Body(Body) {}
   Function *codegen();
+  const PrototypeAST &getProto() const { return *Proto; }
+};
+
+/// ASTArena - Bump allocator owning the expression nodes, argument lists and
+/// identifier strings of the top-level item being compiled. The whole arena
+/// is released in one go once the item has been code generated.
+class ASTArena {
+  BumpPtrAllocator Alloc;
+  StringSaver Saver{Alloc};
+  DenseSet<StringRef> Identifiers;
+
+public:
+  /// create - Construct an expression node in the arena.
+  template <typename T, typename... ArgTs> T *create(ArgTs &&...Args) {
+    static_assert(std::is_trivially_destructible<T>::value,
+                  "arena nodes are never destroyed");
+    return new (Alloc.Allocate<T>()) T(std::forward<ArgTs>(Args)...);
+  }
+
+  /// copy - Copy a list of child nodes (or bindings) into the arena.
+  template <typename T> ArrayRef<T> copy(ArrayRef<T> Nodes) {
+    static_assert(std::is_trivially_destructible<T>::value,
+                  "arena nodes are never destroyed");
+    T *Mem = Alloc.Allocate<T>(Nodes.size());
+    std::uninitialized_copy(Nodes.begin(), Nodes.end(), Mem);
+    return ArrayRef<T>(Mem, Nodes.size());
+  }
+
+  /// intern - Return the arena's unique copy of identifier Name.
+  StringRef intern(StringRef Name) {
+    auto It = Identifiers.find(Name);
+    if (It != Identifiers.end())
+      return *It;
+    StringRef Saved = Saver.save(Name);
+    Identifiers.insert(Saved);
+    return Saved;
+  }
+
+  /// reset - Free every node and string allocated so far.
+  void reset() {
+    Identifiers.clear();
+    Alloc.Reset();
+  }
 };
 } // end of anonymous namespace
 
 //===----------------------------------------------------------------------===//
-// Parser
+// AST simplification
 //===----------------------------------------------------------------------===//
-/// CurTok/getNextToken - Provide a simple token buffer.  CurTok is the current
-/// token the parser is looking at.  getNextToken reads another token from the
-/// lexer and updates CurTok with its results.
-
-/// BinopPrecedence - This holds the precedence for each binary operator that is
-/// defined.
-static std::map<char, int> BinopPrecedence;
-static std::unique_ptr<ExprAST> ParseExpression();
 
-static int CurTok;
-static int getNextToken() { return CurTok = getTok(); }
+static cl::opt<bool> FoldUnsafeMath(
+    "ffold-unsafe-math",
+    cl::desc("Let AST folding use identities that ignore signed zeros, NaNs "
+             "and infinities, and reassociate constants"));
 
-/// LogError - Helper function for error handling.
-std::unique_ptr<ExprAST> LogError(const char *Str) {
-  fprintf(stderr, "Error: %s\n", Str);
-  return nullptr;
+/// isConstant - True if E is the numeric literal C (bitwise, so -0.0 and 0.0
+/// are different).
+static bool isConstant(ExprAST *E, double C) {
+  auto *N = dyn_cast<NumberExprAST>(E);
+  return N && APFloat(N->getVal()).bitwiseIsEqual(APFloat(C));
 }
 
-std::unique_ptr<PrototypeAST> LogErrorP(const char *Str) {
-  LogError(Str);
-  return nullptr;
+/// isDiscardable - True if E can be folded away without losing a side
+/// effect.
+static bool isDiscardable(ExprAST *E) {
+  return isa<NumberExprAST>(E) || isa<VariableExprAST>(E);
 }
 
-/// GetTokPrecedence - Get the precedence of the pending binary operator token.
-static int GetTokPrecedence() {
-  if (!isascii(CurTok))
-    return -1;
+/// foldBinaryExpr - Build "LHS Op RHS", folding it on the way when the result
+/// is known without generating any IR. Only the builtin operators are folded;
+/// user-defined ones may have side effects.
+static ExprAST *foldBinaryExpr(ASTArena &Arena, unsigned char Op,
+                               ExprAST *LHS, ExprAST *RHS) {
+  auto *L = dyn_cast<NumberExprAST>(LHS);
+  auto *R = dyn_cast<NumberExprAST>(RHS);
 
-  // Make sure it's a declared binop.
-  int TokPrec = BinopPrecedence[CurTok];
-  if (TokPrec <= 0)
-    return -1;
-  return TokPrec;
-}
-/// ParseIdentifierExpr - Parse identifiers and function calls.
-static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
-  std::string IdName = IdentifierStr;
-  getNextToken(); // Consume the identifier
+  // Both sides constant: evaluate with the same semantics as the IR would.
+  if (L && R) {
+    double A = L->getVal(), B = R->getVal();
+    switch (Op) {
+    case '+':
+      return Arena.create<NumberExprAST>(A + B);
+    case '-':
+      return Arena.create<NumberExprAST>(A - B);
+    case '*':
+      return Arena.create<NumberExprAST>(A * B);
+    case '/':
+      return Arena.create<NumberExprAST>(A / B);
+    // The orderings are unordered: each is true if either side is a NaN.
+    // Equality is ordered, so a NaN equals nothing.
+    case '<':
+      return Arena.create<NumberExprAST>(!(A >= B) ? 1.0 : 0.0);
+    case '>':
+      return Arena.create<NumberExprAST>(!(A <= B) ? 1.0 : 0.0);
+    case op_le:
+      return Arena.create<NumberExprAST>(!(A > B) ? 1.0 : 0.0);
+    case op_ge:
+      return Arena.create<NumberExprAST>(!(A < B) ? 1.0 : 0.0);
+    case op_eq:
+      return Arena.create<NumberExprAST>(A == B ? 1.0 : 0.0);
+    default:
+      break;
+    }
+  }
 
-  if (CurTok != '(') // Simple variable reference
-    return std::make_unique<VariableExprAST>(IdName);
+  // Identities that hold for every double, including -0.0, NaN and inf.
+  switch (Op) {
+  case '*':
+    if (isConstant(RHS, 1.0))
+      return LHS;
+    if (isConstant(LHS, 1.0))
+      return RHS;
+    break;
+  case '/':
+    if (isConstant(RHS, 1.0))
+      return LHS;
+    break;
+  case '+':
+    if (isConstant(RHS, -0.0))
+      return LHS;
+    if (isConstant(LHS, -0.0))
+      return RHS;
+    break;
+  case '-':
+    if (isConstant(RHS, 0.0))
+      return LHS;
+    break;
+  default:
+    break;
+  }
 
-  // Function call
-  getNextToken(); // Eat '('
-  std::vector<std::unique_ptr<ExprAST>> Args;
-  if (CurTok != ')') {
-    while (true) {
-      if (auto Arg = ParseExpression())
-        Args.push_back(std::move(Arg));
-      else
-        return nullptr;
+  if (!FoldUnsafeMath)
+    return Arena.create<BinaryExprAST>(Op, LHS, RHS);
 
-      if (CurTok == ')')
-        break;
-      if (CurTok != ',')
-        return LogError("Expected ',' or ')' in argument list");
-      getNextToken();
-    }
+  // Identities that assume no signed zeros, NaNs or infinities.
+  switch (Op) {
+  case '+':
+    if (isConstant(RHS, 0.0))
+      return LHS;
+    if (isConstant(LHS, 0.0))
+      return RHS;
+    break;
+  case '*':
+    // Fast-math does not license dropping calls or assignments.
+    if ((isConstant(RHS, 0.0) && isDiscardable(LHS)) ||
+        (isConstant(LHS, 0.0) && isDiscardable(RHS)))
+      return Arena.create<NumberExprAST>(0.0);
+    break;
+  case '-': {
+    auto *LV = dyn_cast<VariableExprAST>(LHS);
+    auto *RV = dyn_cast<VariableExprAST>(RHS);
+    if (LV && RV && LV->getName() == RV->getName())
+      return Arena.create<NumberExprAST>(0.0);
+    break;
+  }
+  default:
+    break;
   }
-  getNextToken(); // Eat ')'
 
-  return std::make_unique<CallExprAST>(IdName, std::move(Args));
-}
+  // Reassociate constants: (X op C1) op C2 -> X op (C1 op C2).
+  if (R && (Op == '+' || Op == '*')) {
+    auto *LB = dyn_cast<BinaryExprAST>(LHS);
+    if (LB && LB->getOp() == Op && isa<NumberExprAST>(LB->getRHS()))
+      return foldBinaryExpr(
+          Arena, Op, LB->getLHS(),
+          foldBinaryExpr(Arena, Op, LB->getRHS(), RHS));
+  }
 
-/// ParseParenExpr - Parse expressions surrounded by parentheses.
-static std::unique_ptr<ExprAST> ParseParenExpr() {
-  getNextToken(); // Eat '('
-  auto V = ParseExpression();
-  if (!V)
-    return nullptr;
-  if (CurTok != ')')
-    return LogError("Expected ')'");
-  getNextToken(); // Eat ')'
-  return V;
+  return Arena.create<BinaryExprAST>(Op, LHS, RHS);
 }
 
-/// ParseNumberExpr - Parse a numeric literal.
-static std::unique_ptr<ExprAST> ParseNumberExpr() {
-  auto result = std::make_unique<NumberExprAST>(NumVal);
-  getNextToken(); // Consume the number
-  return std::move(result);
-}
-/// ParsePrimary - Parse primary expressions.
-static std::unique_ptr<ExprAST> ParsePrimary() {
-  switch (CurTok) {
-  default:
-    return LogError("Unknown token when expecting an expression");
-  case tok_identifier:
-    return ParseIdentifierExpr();
-  case tok_number:
-    return ParseNumberExpr();
-  case '(':
-    return ParseParenExpr();
-  }
+/// foldIfExpr - Build "if Cond then Then else Else", keeping only the arm
+/// that is taken when Cond is a literal.
+static ExprAST *foldIfExpr(ASTArena &Arena, ExprAST *Cond, ExprAST *Then,
+                           ExprAST *Else) {
+  if (auto *C = dyn_cast<NumberExprAST>(Cond))
+    // fcmp one: a NaN condition is false, like zero.
+    return C->getVal() < 0 || C->getVal() > 0 ? Then : Else;
+  return Arena.create<IfExprAST>(Cond, Then, Else);
 }
 
-/// binoprhs
-///   ::= ('+' primary)*
-static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
-                                              std::unique_ptr<ExprAST> LHS) {
-  // If this is a binop, find its precedence.
-  while (true) {
-    int TokPrec = GetTokPrecedence();
+//===----------------------------------------------------------------------===//
+// Parser
+//===----------------------------------------------------------------------===//
 
-    // If this is a binop that binds at least as tightly as the current binop,
-    // consume it, otherwise we are done.
-    if (TokPrec < ExprPrec)
-      return LHS;
+namespace {
 
-    // Okay, we know this is a binop.
-    int BinOp = CurTok;
+/// DiagnosticList - The errors reported in one source unit, kept in order
+/// until flushed. A unit's errors are then printed in a single write, so
+/// that units compiled concurrently do not interleave theirs.
+class DiagnosticList {
+  struct Diagnostic {
+    SourceLocation Loc;
+    std::string Message;
+  };
+
+  std::string BufferName;
+  std::vector<Diagnostic> Diags;
+
+public:
+  /// ItemLoc - Where the top-level item being compiled starts. Errors found
+  /// after parsing, which have no token to point at, are reported there.
+  SourceLocation ItemLoc;
+
+  explicit DiagnosticList(StringRef BufferName) : BufferName(BufferName) {}
+
+  void report(SourceLocation Loc, const Twine &Message) {
+    Diags.push_back({Loc, Message.str()});
+  }
+
+  /// flush - Print and forget the errors reported so far.
+  void flush() {
+    if (Diags.empty())
+      return;
+    std::string Out;
+    raw_string_ostream OS(Out);
+    for (auto &D : Diags)
+      OS << BufferName << ':' << D.Loc.Line << ':' << D.Loc.Col
+         << ": error: " << D.Message << '\n';
+    OS.flush();
+    fputs(Out.c_str(), stderr);
+    Diags.clear();
+  }
+};
+
+} // end of anonymous namespace
+
+/// CurDiags - The diagnostics of the source unit this thread is parsing, if
+/// any (see Parser).
+static thread_local DiagnosticList *CurDiags = nullptr;
+
+/// LogError - Helper function for error handling.
+ExprAST *LogError(const char *Str) {
+  if (CurDiags)
+    CurDiags->report(CurDiags->ItemLoc, Str);
+  else
+    fprintf(stderr, "Error: %s\n", Str);
+  return nullptr;
+}
+
+namespace {
+
+/// OperatorTable - Precedence and associativity of every binary operator,
+/// indexed directly by the operator's character so that precedence climbing
+/// costs one array load per token. Entries with a negative precedence are
+/// not operators.
+class OperatorTable {
+public:
+  struct BinopInfo {
+    int Precedence = -1;
+    bool RightAssoc = false;
+  };
+
+private:
+  std::array<BinopInfo, 256> Ops;
+
+public:
+  /// define - Install (or redefine) the binary operator Op.
+  void define(unsigned char Op, int Precedence, bool RightAssoc = false) {
+    Ops[Op] = {Precedence, RightAssoc};
+  }
+
+  /// lookup - Get the entry for token Tok; keyword and identifier tokens are
+  /// negative and never operators.
+  BinopInfo lookup(int Tok) const {
+    if (Tok < 0 || Tok >= (int)Ops.size())
+      return BinopInfo();
+    return Ops[Tok];
+  }
+
+  /// hash - Fold every defined operator into H.
+  void hash(MD5 &H) const {
+    for (unsigned Op = 0, E = Ops.size(); Op != E; ++Op) {
+      if (Ops[Op].Precedence < 0)
+        continue;
+      uint8_t Entry[] = {uint8_t(Op), uint8_t(Ops[Op].Precedence),
+                         uint8_t(Ops[Op].RightAssoc)};
+      H.update(Entry);
+    }
+  }
+};
+
+/// Parser - A recursive-descent parser over a single Lexer. It owns the token
+/// buffer and the operator precedence table, so each source unit gets its own
+/// Parser and several can run at once on different threads.
+class Parser {
+  Lexer &Lex;
+
+  /// CurTok/getNextToken - Provide a simple token buffer.  CurTok is the
+  /// current token the parser is looking at.  getNextToken reads another token
+  /// from the lexer and updates CurTok with its results.
+  int CurTok = 0;
+
+  /// BinopPrecedence - This holds the precedence for each binary operator that
+  /// is defined, including user-defined ones.
+  OperatorTable BinopPrecedence;
+
+  /// Arena - Owns the expression nodes of the item being parsed.
+  ASTArena Arena;
+
+  /// TokenHash - While set, every token consumed is folded into it, which
+  /// digests an item's source independently of whitespace and comments.
+  MD5 *TokenHash = nullptr;
+  void hashCurTok();
+
+  /// Diags - The errors in this source unit. While the parser exists, they
+  /// also collect the errors code generation reports on this thread.
+  DiagnosticList Diags;
+  DiagnosticList *PrevDiags;
+
+  /// LogError/LogErrorP - Report a syntax error at the current token.
+  ExprAST *LogError(const char *Str) {
+    Diags.report(Lex.getTokLoc(), Str);
+    return nullptr;
+  }
+  std::unique_ptr<PrototypeAST> LogErrorP(const char *Str) {
+    LogError(Str);
+    return nullptr;
+  }
+
+  /// startItem - Note that a top-level item starts at the current token.
+  void startItem() { Diags.ItemLoc = Lex.getTokLoc(); }
+
+  int GetTokPrecedence();
+  ExprAST *ParseIdentifierExpr();
+  ExprAST *ParseParenExpr();
+  ExprAST *ParseNumberExpr();
+  ExprAST *ParseIfExpr();
+  ExprAST *ParseForExpr();
+  ExprAST *ParseVarExpr();
+  ExprAST *ParseIndexExpr(ExprAST *Base);
+  ExprAST *ParsePrimary();
+  bool ParseType(ValueType &Ty);
+  ExprAST *ParseBinOpRHS(int ExprPrec, ExprAST *LHS);
+  ExprAST *ParseExpression();
+  std::unique_ptr<PrototypeAST> ParsePrototype();
+
+public:
+  explicit Parser(Lexer &Lex)
+      : Lex(Lex), Diags(Lex.getBufferName()), PrevDiags(CurDiags) {
+    CurDiags = &Diags;
+    // Install standard binary operators.
+    // 1 is lowest precedence.
+    BinopPrecedence.define('=', 2, /*RightAssoc=*/true);
+    BinopPrecedence.define(op_eq, 5);
+    BinopPrecedence.define('<', 10);
+    BinopPrecedence.define('>', 10);
+    BinopPrecedence.define(op_le, 10);
+    BinopPrecedence.define(op_ge, 10);
+    BinopPrecedence.define('+', 20);
+    BinopPrecedence.define('-', 20);
+    BinopPrecedence.define('*', 40); // highest.
+    BinopPrecedence.define('/', 40);
+  }
+
+  ~Parser() {
+    Diags.flush();
+    CurDiags = PrevDiags;
+  }
+
+  Parser(const Parser &) = delete;
+  Parser &operator=(const Parser &) = delete;
+
+  int getCurTok() const { return CurTok; }
+  int getNextToken() {
+    TimePhase Lexing(PhaseLex);
+    if (TokenHash)
+      hashCurTok();
+    return CurTok = Lex.getTok();
+  }
+  bool isInteractive() const { return Lex.isInteractive(); }
+
+  /// synchronize - Recover from a syntax error by skipping to the start of
+  /// the next top-level item: past the next ';', or up to the next 'fn' or
+  /// 'import'. Every token is read once, however many errors there are.
+  void synchronize() {
+    while (CurTok != ';' && CurTok != tok_fun && CurTok != tok_imp &&
+           CurTok != tok_eof)
+      getNextToken();
+    if (CurTok == ';')
+      getNextToken();
+  }
+
+  /// flushDiagnostics - Print the errors reported so far.
+  void flushDiagnostics() { Diags.flush(); }
+
+  /// releaseAST - Free the expression nodes of every item parsed so far. Call
+  /// once the item has been code generated (or rejected).
+  void releaseAST() { Arena.reset(); }
+
+  const OperatorTable &getOperators() const { return BinopPrecedence; }
+
+  std::unique_ptr<FunctionAST> ParseFunDef(MD5 *SourceHash = nullptr);
+  std::unique_ptr<PrototypeAST> ParseImport();
+  std::unique_ptr<FunctionAST> ParseTopLevelExpr();
+};
+
+} // end of anonymous namespace
+
+/// hashCurTok - Fold the current token, with its identifier or value, into
+/// TokenHash.
+void Parser::hashCurTok() {
+  TokenHash->update(ArrayRef<uint8_t>(
+      reinterpret_cast<const uint8_t *>(&CurTok), sizeof(CurTok)));
+  if (CurTok == tok_identifier) {
+    TokenHash->update(Lex.getIdentifier());
+    TokenHash->update(StringRef("", 1));
+  }
+  if (CurTok == tok_number) {
+    double Val = Lex.getNumVal();
+    TokenHash->update(ArrayRef<uint8_t>(
+        reinterpret_cast<const uint8_t *>(&Val), sizeof(Val)));
+  }
+}
+
+/// GetTokPrecedence - Get the precedence of the pending binary operator token.
+int Parser::GetTokPrecedence() {
+  // Make sure it's a declared binop.
+  int TokPrec = BinopPrecedence.lookup(CurTok).Precedence;
+  if (TokPrec <= 0)
+    return -1;
+  return TokPrec;
+}
+/// ParseIdentifierExpr - Parse identifiers and function calls.
+ExprAST *Parser::ParseIdentifierExpr() {
+  StringRef IdName = Arena.intern(Lex.getIdentifier());
+  getNextToken(); // Consume the identifier
+
+  if (CurTok != '(') // Simple variable reference
+    return Arena.create<VariableExprAST>(IdName);
+
+  // Function call
+  getNextToken(); // Eat '('
+  SmallVector<ExprAST *, 8> Args;
+  if (CurTok != ')') {
+    while (true) {
+      if (auto *Arg = ParseExpression())
+        Args.push_back(Arg);
+      else
+        return nullptr;
+
+      if (CurTok == ')')
+        break;
+      if (CurTok != ',')
+        return LogError("Expected ',' or ')' in argument list");
+      getNextToken();
+    }
+  }
+  getNextToken(); // Eat ')'
+
+  return Arena.create<CallExprAST>(IdName, Arena.copy<ExprAST *>(Args));
+}
+
+/// ParseParenExpr - Parse expressions surrounded by parentheses.
+ExprAST *Parser::ParseParenExpr() {
+  getNextToken(); // Eat '('
+  auto *V = ParseExpression();
+  if (!V)
+    return nullptr;
+  if (CurTok != ')')
+    return LogError("Expected ')'");
+  getNextToken(); // Eat ')'
+  return V;
+}
+
+/// ParseNumberExpr - Parse a numeric literal.
+ExprAST *Parser::ParseNumberExpr() {
+  auto *Result = Arena.create<NumberExprAST>(Lex.getNumVal());
+  getNextToken(); // Consume the number
+  return Result;
+}
+
+/// ifexpr ::= 'if' expression 'then' expression 'else' expression
+ExprAST *Parser::ParseIfExpr() {
+  getNextToken(); // eat the if.
+
+  auto *Cond = ParseExpression();
+  if (!Cond)
+    return nullptr;
+
+  if (CurTok != tok_then)
+    return LogError("expected then");
+  getNextToken(); // eat the then
+
+  auto *Then = ParseExpression();
+  if (!Then)
+    return nullptr;
+
+  if (CurTok != tok_else)
+    return LogError("expected else");
+  getNextToken(); // eat the else
+
+  auto *Else = ParseExpression();
+  if (!Else)
+    return nullptr;
+
+  return foldIfExpr(Arena, Cond, Then, Else);
+}
+
+/// forexpr ::= 'for' identifier '=' expression ',' expression
+///             (',' expression)? 'in' expression
+ExprAST *Parser::ParseForExpr() {
+  getNextToken(); // eat the for.
+
+  if (CurTok != tok_identifier)
+    return LogError("expected identifier after for");
+
+  StringRef IdName = Arena.intern(Lex.getIdentifier());
+  getNextToken(); // eat identifier.
+
+  if (CurTok != '=')
+    return LogError("expected '=' after for");
+  getNextToken(); // eat '='.
+
+  auto *Start = ParseExpression();
+  if (!Start)
+    return nullptr;
+  if (CurTok != ',')
+    return LogError("expected ',' after for start value");
+  getNextToken(); // eat ','.
+
+  auto *End = ParseExpression();
+  if (!End)
+    return nullptr;
+
+  // The step value is optional.
+  ExprAST *Step = nullptr;
+  if (CurTok == ',') {
+    getNextToken(); // eat ','.
+    Step = ParseExpression();
+    if (!Step)
+      return nullptr;
+  }
+
+  if (CurTok != tok_in)
+    return LogError("expected 'in' after for");
+  getNextToken(); // eat 'in'.
+
+  auto *Body = ParseExpression();
+  if (!Body)
+    return nullptr;
+
+  return Arena.create<ForExprAST>(IdName, Start, End, Step, Body);
+}
+
+/// varexpr ::= 'var' identifier ('=' expression)?
+///                    (',' identifier ('=' expression)?)* 'in' expression
+ExprAST *Parser::ParseVarExpr() {
+  getNextToken(); // eat the var.
+
+  SmallVector<VarExprAST::VarBinding, 4> VarNames;
+
+  // At least one variable name is required.
+  if (CurTok != tok_identifier)
+    return LogError("expected identifier after var");
+
+  while (true) {
+    StringRef Name = Arena.intern(Lex.getIdentifier());
+    getNextToken(); // eat identifier.
+
+    // Read the optional initializer.
+    ExprAST *Init = nullptr;
+    if (CurTok == '=') {
+      getNextToken(); // eat the '='.
+
+      Init = ParseExpression();
+      if (!Init)
+        return nullptr;
+    }
+
+    VarNames.push_back({Name, Init});
+
+    // End of var list, exit loop.
+    if (CurTok != ',')
+      break;
+    getNextToken(); // eat the ','.
+
+    if (CurTok != tok_identifier)
+      return LogError("expected identifier list after var");
+  }
+
+  // At this point, we have to have 'in'.
+  if (CurTok != tok_in)
+    return LogError("expected 'in' keyword after 'var'");
+  getNextToken(); // eat 'in'.
+
+  auto *Body = ParseExpression();
+  if (!Body)
+    return nullptr;
+
+  return Arena.create<VarExprAST>(Arena.copy<VarExprAST::VarBinding>(VarNames),
+                                  Body);
+}
+
+/// indexexpr ::= primary ('[' expression ']')*
+ExprAST *Parser::ParseIndexExpr(ExprAST *Base) {
+  while (Base && CurTok == '[') {
+    getNextToken(); // eat '['.
+    auto *Index = ParseExpression();
+    if (!Index)
+      return nullptr;
+    if (CurTok != ']')
+      return LogError("expected ']' after index");
+    getNextToken(); // eat ']'.
+    Base = Arena.create<IndexExprAST>(Base, Index);
+  }
+  return Base;
+}
+
+/// ParsePrimary - Parse primary expressions.
+ExprAST *Parser::ParsePrimary() {
+  switch (CurTok) {
+  default:
+    return LogError("Unknown token when expecting an expression");
+  case tok_invalid:
+    return LogError("invalid character: source must be ASCII");
+  case tok_identifier:
+    return ParseIndexExpr(ParseIdentifierExpr());
+  case tok_number:
+    return ParseNumberExpr();
+  case '(':
+    return ParseIndexExpr(ParseParenExpr());
+  case tok_if:
+    return ParseIfExpr();
+  case tok_for:
+    return ParseForExpr();
+  case tok_var:
+    return ParseVarExpr();
+  }
+}
+
+/// binoprhs
+///   ::= ('+' primary)*
+ExprAST *Parser::ParseBinOpRHS(int ExprPrec, ExprAST *LHS) {
+  // If this is a binop, find its precedence.
+  while (true) {
+    int TokPrec = GetTokPrecedence();
+
+    // If this is a binop that binds at least as tightly as the current binop,
+    // consume it, otherwise we are done.
+    if (TokPrec < ExprPrec)
+      return LHS;
+
+    // Okay, we know this is a binop.
+    int BinOp = CurTok;
     getNextToken(); // eat binop
 
-    // Parse the primary expression after the binary operator.
-    auto RHS = ParsePrimary();
-    if (!RHS)
-      return nullptr;
+    // Parse the primary expression after the binary operator.
+    auto *RHS = ParsePrimary();
+    if (!RHS)
+      return nullptr;
+
+    // If BinOp binds less tightly with RHS than the operator after RHS, or
+    // as tightly and BinOp is right associative, let the pending operator
+    // take RHS as its LHS.
+    int NextPrec = GetTokPrecedence();
+    bool RightAssoc = BinopPrecedence.lookup(BinOp).RightAssoc;
+    if (TokPrec < NextPrec || (RightAssoc && TokPrec == NextPrec)) {
+      RHS = ParseBinOpRHS(RightAssoc ? TokPrec : TokPrec + 1, RHS);
+      if (!RHS)
+        return nullptr;
+    }
+
+    // Merge LHS/RHS, folding constant subtrees as we go.
+    LHS = foldBinaryExpr(Arena, BinOp, LHS, RHS);
+  }
+}
+
+/// expression
+///   ::= primary binoprhs
+///
+ExprAST *Parser::ParseExpression() {
+  auto *LHS = ParsePrimary();
+  if (!LHS)
+    return nullptr;
+
+  return ParseBinOpRHS(0, LHS);
+}
+
+/// type ::= ':' ('double' | 'ptr')
+bool Parser::ParseType(ValueType &Ty) {
+  getNextToken(); // eat ':'.
+  if (CurTok == tok_identifier && Lex.getIdentifier() == "double")
+    Ty = ValueType::Double;
+  else if (CurTok == tok_identifier && Lex.getIdentifier() == "ptr")
+    Ty = ValueType::Ptr;
+  else {
+    LogError("Expected type 'double' or 'ptr'");
+    return false;
+  }
+  getNextToken(); // eat the type.
+  return true;
+}
+
+// prototype
+///   ::= id '(' (id type?)* ')' type?
+///   ::= binary LETTER number? 'right'? (id id)
+std::unique_ptr<PrototypeAST> Parser::ParsePrototype() {
+  std::string FnName;
+  int BinaryPrecedence = 0;
+  bool RightAssoc = false;
+
+  switch (CurTok) {
+  default:
+    return LogErrorP("Expected function name in prototype");
+  case tok_identifier:
+    FnName = Lex.getIdentifier().str();
+    getNextToken();
+    break;
+  case tok_binary:
+    getNextToken();
+    if (CurTok < 0 || CurTok > 127 || isalnum(CurTok) || CurTok == '(' ||
+        CurTok == ',' || CurTok == ';')
+      return LogErrorP("Expected binary operator");
+    FnName = "binary";
+    FnName += (char)CurTok;
+    getNextToken();
+
+    // Read the precedence if present.
+    BinaryPrecedence = 30;
+    if (CurTok == tok_number) {
+      if (Lex.getNumVal() < 1 || Lex.getNumVal() > 100)
+        return LogErrorP("Invalid precedence: must be 1..100");
+      BinaryPrecedence = (int)Lex.getNumVal();
+      getNextToken();
+    }
+
+    // Read the associativity if present.
+    if (CurTok == tok_identifier && Lex.getIdentifier() == "right") {
+      RightAssoc = true;
+      getNextToken();
+    }
+    break;
+  }
+
+  if (CurTok != '(')
+    return LogErrorP("Expected '(' in prototype");
+
+  std::vector<std::string> ArgNames;
+  std::vector<ValueType> ArgTypes;
+  getNextToken(); // eat '('.
+  while (CurTok == tok_identifier) {
+    ArgNames.push_back(Lex.getIdentifier().str());
+    getNextToken();
+    ValueType Ty = ValueType::Double;
+    if (CurTok == ':' && !ParseType(Ty))
+      return nullptr;
+    ArgTypes.push_back(Ty);
+  }
+  if (CurTok != ')')
+    return LogErrorP("Expected ')' in prototype");
+
+  // Verify right number of names for operator.
+  if (BinaryPrecedence && ArgNames.size() != 2)
+    return LogErrorP("Invalid number of operands for operator");
+
+  // success.
+  getNextToken(); // eat ')'.
+
+  ValueType RetType = ValueType::Double;
+  if (CurTok == ':' && !ParseType(RetType))
+    return nullptr;
+
+  // Install the operator now so the body (and everything after) can use it.
+  if (BinaryPrecedence)
+    BinopPrecedence.define(FnName.back(), BinaryPrecedence, RightAssoc);
+
+  return std::make_unique<PrototypeAST>(FnName, std::move(ArgNames),
+                                        std::move(ArgTypes), RetType);
+}
+
+/// function definition ::= 'fn'
+///
+/// If SourceHash is given, the definition's tokens are folded into it.
+std::unique_ptr<FunctionAST> Parser::ParseFunDef(MD5 *SourceHash) {
+  TimePhase Parsing(PhaseParse);
+  TokenHash = SourceHash;
+  auto StopHashing = make_scope_exit([&] { TokenHash = nullptr; });
+  startItem();
+  getNextToken(); // eat fn
+  auto Proto = ParsePrototype();
+  if (!Proto)
+    return nullptr;
+  if (auto *E = ParseExpression())
+    return std::make_unique<FunctionAST>(std::move(Proto), E);
+  return nullptr;
+}
+/// import ::= 'import' prototype
+std::unique_ptr<PrototypeAST> Parser::ParseImport() {
+  TimePhase Parsing(PhaseParse);
+  startItem();
+  getNextToken(); // eat Import
+  auto Proto = ParsePrototype();
+  if (Proto)
+    Proto->setImported();
+  return Proto;
+}
+/// topLevelexpr ::= expression
+std::unique_ptr<FunctionAST> Parser::ParseTopLevelExpr() {
+  TimePhase Parsing(PhaseParse);
+  startItem();
+  if (auto *E = ParseExpression()) {
+    // make an anonymous proto
+    auto Proto = std::make_unique<PrototypeAST>("__anon_expr",
+                                                std::vector<std::string>());
+    return std::make_unique<FunctionAST>(std::move(Proto), E);
+  }
+  return nullptr;
+}
+
+//===-----------------------------------------------------------------------==//
+// CODE GEN
+//===-----------------------------------------------------------------------==//
+static cl::list<std::string> InputFilenames(cl::Positional,
+                                            cl::desc("<input files>"),
+                                            cl::ZeroOrMore);
+
+static cl::opt<unsigned>
+    NumJobs("j",
+            cl::desc("Number of files to compile in parallel when given "
+                     "several inputs (default = number of hardware threads)"),
+            cl::Prefix, cl::init(0));
+
+/// EmitKind - What to do with the compiled code.
+enum class EmitKind { JIT, Assembly, Bitcode, Object };
+
+static cl::opt<EmitKind> Emit(
+    cl::desc("Output mode (default: run through the JIT):"),
+    cl::values(clEnumValN(EmitKind::Object, "emit-obj",
+                          "Write a native object file for the host"),
+               clEnumValN(EmitKind::Bitcode, "emit-bc", "Write LLVM bitcode"),
+               clEnumValN(EmitKind::Assembly, "emit-asm",
+                          "Write native assembly for the host")),
+    cl::init(EmitKind::JIT));
+
+static cl::opt<std::string>
+    OutputFilename("o", cl::desc("Output filename for -emit-* modes"),
+                   cl::value_desc("filename"));
+
+static cl::opt<bool>
+    PrintIR("print-ir",
+            cl::desc("Print the IR of each item as it is compiled (default: "
+                     "on in the REPL, off when emitting files)"));
+
+static cl::opt<bool> BatchKernels(
+    "batch-kernels",
+    cl::desc("Also emit a vectorizable columnar kernel 'void <fn>_batch(const "
+             "double *arg0, ..., double *out, size_t n)' for every function"));
+
+static cl::opt<bool> LazyCompile(
+    "lazy",
+    cl::desc("Defer optimizing and compiling each function until it is first "
+             "called"));
+
+static cl::opt<bool> Redefine(
+    "redefine",
+    cl::desc("Let a definition replace an earlier one of the same name. "
+             "Definitions are then called through stubs and are not inlined "
+             "into each other"));
+
+static cl::opt<bool> Tiered(
+    "tiered",
+    cl::desc("Compile definitions unoptimized, with counters for calls and "
+             "branches, and recompile each one using its profile once it is "
+             "hot (see -tier-up-threshold). Ignored with multiple input "
+             "files"));
+
+static cl::opt<uint64_t> TierUpThreshold(
+    "tier-up-threshold",
+    cl::desc("Calls after which -tiered recompiles a definition (default = "
+             "1000)"),
+    cl::value_desc("calls"), cl::init(1000));
+
+static cl::opt<unsigned> ExprBatchSize(
+    "expr-batch",
+    cl::desc("Compile up to <n> consecutive top-level expressions into one "
+             "module and run them together, unless stdin is a terminal "
+             "(default = 1)"),
+    cl::value_desc("n"), cl::init(1));
+
+static cl::opt<unsigned> ExprBatchMs(
+    "expr-batch-ms",
+    cl::desc("Run a partial -expr-batch once its first expression has waited "
+             "<ms> milliseconds, even while no more input arrives (default = "
+             "0, no limit)"),
+    cl::value_desc("ms"), cl::init(0));
+
+static cl::opt<std::string> CacheDir(
+    "cache-dir",
+    cl::desc("Keep the compiled code of each definition in <dir> and reuse it "
+             "on later runs instead of compiling the definition again"),
+    cl::value_desc("dir"));
+
+static cl::opt<char> OptLevel("O",
+                              cl::desc("Optimization level. [-O0, -O1, -O2, or "
+                                       "-O3] (default = '-O2')"),
+                              cl::Prefix, cl::init('2'));
+
+static cl::opt<bool> FastMath(
+    "fast-math",
+    cl::desc("Let floating-point math be reassociated and contracted, and "
+             "assume there are no NaNs, infinities or signed zeros (implies "
+             "-fassociative-math, -ffp-contract=fast, -ffinite-math-only and "
+             "-fno-signed-zeros)"));
+
+static cl::opt<bool> AssociativeMath(
+    "fassociative-math",
+    cl::desc("Let floating-point operations be reassociated, which sum and "
+             "product reductions need to vectorize"));
+
+enum class FPContractKind { Off, Fast };
+
+static cl::opt<FPContractKind> FPContract(
+    "ffp-contract", cl::desc("Fuse floating-point multiplies and adds:"),
+    cl::values(clEnumValN(FPContractKind::Off, "off", "Never (default)"),
+               clEnumValN(FPContractKind::Fast, "fast",
+                          "Whenever the target has FMA instructions")),
+    cl::init(FPContractKind::Off));
+
+static cl::opt<bool>
+    FiniteMathOnly("ffinite-math-only",
+                   cl::desc("Assume floating-point values are never NaN or "
+                            "infinite"));
+
+static cl::opt<bool>
+    NoSignedZeros("fno-signed-zeros",
+                  cl::desc("Ignore the sign of floating-point zeros"));
+
+static cl::opt<std::string> TargetCPU(
+    "march",
+    cl::desc("Generate code for <cpu>, or 'native' for the host CPU with all "
+             "of its features (default = generic)"),
+    cl::value_desc("cpu"));
+
+static cl::alias TargetCPUAlias("mcpu", cl::desc("Alias for -march"),
+                                cl::aliasopt(TargetCPU));
+
+static cl::list<std::string>
+    TargetAttrs("mattr", cl::CommaSeparated,
+                cl::desc("Target features to enable (+feature) or disable "
+                         "(-feature), e.g. -mattr=+avx2,+fma"),
+                cl::value_desc("a1,+a2,-a3,..."));
+
+/// getFastMathFlags - The flags every floating-point operation is built with.
+static FastMathFlags getFastMathFlags() {
+  FastMathFlags FMF;
+  if (FastMath) {
+    FMF.setFast();
+    return FMF;
+  }
+  FMF.setAllowReassoc(AssociativeMath);
+  FMF.setAllowContract(FPContract == FPContractKind::Fast);
+  FMF.setNoNaNs(FiniteMathOnly);
+  FMF.setNoInfs(FiniteMathOnly);
+  FMF.setNoSignedZeros(NoSignedZeros);
+  return FMF;
+}
+
+/// getTargetCPU - The CPU named by -march, with 'native' resolved.
+static std::string getTargetCPU() {
+  if (TargetCPU == "native")
+    return sys::getHostCPUName().str();
+  return TargetCPU;
+}
+
+/// getTargetFeatures - The features of the -march=native host, if asked for,
+/// followed by the -mattr list.
+static SubtargetFeatures getTargetFeatures() {
+  SubtargetFeatures Features;
+  StringMap<bool> HostFeatures;
+  if (TargetCPU == "native" && sys::getHostCPUFeatures(HostFeatures)) {
+    // Sort them, as the features are part of every cache key.
+    std::vector<std::string> Names;
+    for (auto &F : HostFeatures)
+      Names.push_back((F.second ? "+" : "-") + F.first().str());
+    llvm::sort(Names);
+    for (auto &Name : Names)
+      Features.AddFeature(Name);
+  }
+  for (auto &Attr : TargetAttrs)
+    Features.AddFeature(Attr);
+  return Features;
+}
+
+/// getFPOpFusion - How the backend may fuse floating-point operations.
+static FPOpFusion::FPOpFusionMode getFPOpFusion() {
+  return FastMath || FPContract == FPContractKind::Fast ? FPOpFusion::Fast
+                                                        : FPOpFusion::Standard;
+}
+
+/// configureJITTarget - Apply -march, -mattr and -ffp-contract to the JIT.
+static void configureJITTarget(orc::JITTargetMachineBuilder &JTMB) {
+  JTMB.setCPU(getTargetCPU());
+  JTMB.addFeatures(getTargetFeatures().getFeatures());
+  JTMB.getOptions().AllowFPOpFusion = getFPOpFusion();
+}
+
+// Code generation state is per thread: every batch worker compiles into its
+// own LLVMContext and Module, while the JIT below is shared by all of them.
+static thread_local std::unique_ptr<LLVMContext> TheContext;
+static thread_local std::unique_ptr<IRBuilder<>> Builder;
+static thread_local std::unique_ptr<Module> TheModule;
+static thread_local std::unique_ptr<FunctionPassManager> TheFPM;
+static thread_local std::unique_ptr<LoopAnalysisManager> TheLAM;
+static thread_local std::unique_ptr<FunctionAnalysisManager> TheFAM;
+static thread_local std::unique_ptr<CGSCCAnalysisManager> TheCGAM;
+static thread_local std::unique_ptr<ModuleAnalysisManager> TheMAM;
+
+/// NamedValues - The stack slots of the variables visible at the current
+/// point of codegen. Each lookup is a single hash probe that never inserts; a
+/// SymbolScope pushes a new scope whose bindings shadow outer ones and
+/// disappear when it ends.
+using SymbolTable = ScopedHashTable<StringRef, AllocaInst *>;
+using SymbolScope = ScopedHashTableScope<StringRef, AllocaInst *>;
+static thread_local SymbolTable NamedValues;
+static thread_local std::map<std::string, std::unique_ptr<PrototypeAST>>
+    FunctionProtos;
+static thread_local std::unique_ptr<TargetMachine> TheTargetMachine;
+static thread_local unsigned AnonExprCount = 0;
+/// PrevDefinitionKey - The -cache-dir key of the last definition compiled,
+/// which the next definition's key chains in.
+static thread_local std::string PrevDefinitionKey;
+// The object cache is declared first so that it outlives the JIT using it.
+static std::unique_ptr<orc::DiskObjectCache> TheObjectCache;
+static std::unique_ptr<orc::IsereJIT> TheJIT;
+static ExitOnError ExitOnErr;
+
+/// isLazy - Whether definitions are optimized and compiled on first call.
+static bool isLazy() { return LazyCompile && TheJIT; }
+
+/// isRedefinable - Whether definitions may replace earlier ones.
+static bool isRedefinable() { return Redefine && TheJIT; }
+
+/// isTiered - Whether definitions start out unoptimized and instrumented.
+static bool isTiered() { return Tiered && TheJIT; }
+
+/// isCollectingStats - Whether definitions are instrumented for
+/// -function-stats. The counters' addresses are built into the code, so only
+/// JIT'd code can have them.
+static bool isCollectingStats() {
+  return FunctionStatsFormat != StatsFormat::None && TheJIT;
+}
+
+/// usesStubs - Whether definitions are called through stubs, so that their
+/// code can be swapped (see redirectDefinition).
+static bool usesStubs() { return isRedefinable() || isTiered(); }
+
+/// isLazyDefinition - Whether Proto's definition goes to the JIT lazily. Top-
+/// level expressions run straight away, so they are always eager.
+static bool isLazyDefinition(const PrototypeAST &Proto) {
+  return isLazy() && Proto.getName() != "__anon_expr";
+}
+
+/// hasBatchKernel - Whether Proto's definition comes with a -batch-kernels
+/// kernel, which is only built for functions over doubles.
+static bool hasBatchKernel(const PrototypeAST &Proto) {
+  return BatchKernels && Proto.getName() != "__anon_expr" && Proto.isNumeric();
+}
+
+//---- EXPRESSION CODE GEN ----//
+
+/// getLLVMType - The IR type values of type Ty are held in.
+static Type *getLLVMType(ValueType Ty) {
+  Type *DoubleTy = Type::getDoubleTy(*TheContext);
+  return Ty == ValueType::Ptr ? PointerType::getUnqual(DoubleTy) : DoubleTy;
+}
+
+Value *LogErrorV(const char *Str) {
+  LogError(Str);
+  return nullptr;
+}
+
+/// getFunction - Find a function by name in the current module, or re-emit
+/// its declaration from a previously seen prototype. Every definition lives in
+/// its own JIT'd module, so callers need a declaration in theirs.
+Function *getFunction(std::string Name) {
+  if (auto *F = TheModule->getFunction(Name))
+    return F;
+
+  auto FI = FunctionProtos.find(Name);
+  if (FI != FunctionProtos.end())
+    return FI->second->codegen();
+
+  return nullptr;
+}
+
+Value *NumberExprAST::codegen() {
+  return ConstantFP::get(*TheContext, APFloat(Val));
+}
+
+/// CreateEntryBlockAlloca - Create an alloca instruction in the entry block of
+/// the function. Variables live in such stack slots until mem2reg promotes
+/// them to registers.
+static AllocaInst *CreateEntryBlockAlloca(Function *TheFunction,
+                                          StringRef VarName, Type *Ty) {
+  IRBuilder<> TmpB(&TheFunction->getEntryBlock(),
+                   TheFunction->getEntryBlock().begin());
+  return TmpB.CreateAlloca(Ty, nullptr, VarName);
+}
+
+/// isDouble - Whether V holds a number, as arithmetic needs.
+static bool isDouble(Value *V) { return V->getType()->isDoubleTy(); }
+
+Value *VariableExprAST::codegen() {
+  // find this variable in the function
+  AllocaInst *A = NamedValues.lookup(Name);
+  if (!A)
+    return LogErrorV("Unknown Variable name");
+  return Builder->CreateLoad(A->getAllocatedType(), A, Name);
+}
+
+Value *ExprAST::codegenValueCond(const Twine &Name) {
+  Value *V = codegen();
+  if (!V)
+    return nullptr;
+  if (!isDouble(V))
+    return LogErrorV("condition must be a number");
+  // Convert to a bool by comparing non-equal to 0.0.
+  return Builder->CreateFCmpONE(
+      V, ConstantFP::get(*TheContext, APFloat(0.0)), Name);
+}
+
+/// getComparePredicate - The fcmp predicate of the builtin comparison Op, or
+/// BAD_FCMP_PREDICATE if Op is not one. Like their folds in foldBinaryExpr,
+/// the orderings are true if either side is a NaN and '==' is false.
+static CmpInst::Predicate getComparePredicate(unsigned char Op) {
+  switch (Op) {
+  case '<':
+    return CmpInst::FCMP_ULT;
+  case '>':
+    return CmpInst::FCMP_UGT;
+  case op_le:
+    return CmpInst::FCMP_ULE;
+  case op_ge:
+    return CmpInst::FCMP_UGE;
+  case op_eq:
+    return CmpInst::FCMP_OEQ;
+  default:
+    return CmpInst::BAD_FCMP_PREDICATE;
+  }
+}
+
+Value *BinaryExprAST::codegenCond(const Twine &Name) {
+  CmpInst::Predicate Pred = getComparePredicate(Op);
+  if (Pred == CmpInst::BAD_FCMP_PREDICATE)
+    return codegenValueCond(Name);
+
+  Value *L = LHS->codegen();
+  Value *R = RHS->codegen();
+  if (!L || !R)
+    return nullptr;
+  if (!isDouble(L) || !isDouble(R))
+    return LogErrorV("operands of a comparison must be numbers");
+  return Builder->CreateFCmp(Pred, L, R, Name);
+}
+
+Value *BinaryExprAST::codegen() {
+  // Special case '=' because we don't want to emit the LHS as an expression.
+  if (Op == '=') {
+    // Assignment requires the LHS to be an identifier or an element.
+    if (auto *LHSE = dyn_cast<IndexExprAST>(LHS)) {
+      Value *Addr = LHSE->codegenAddress();
+      if (!Addr)
+        return nullptr;
+      Value *Val = RHS->codegen();
+      if (!Val)
+        return nullptr;
+      if (!isDouble(Val))
+        return LogErrorV("only numbers can be stored in a buffer");
+      Builder->CreateStore(Val, Addr);
+      return Val;
+    }
+
+    auto *LHSE = dyn_cast<VariableExprAST>(LHS);
+    if (!LHSE)
+      return LogErrorV("destination of '=' must be a variable or an element");
+    Value *Val = RHS->codegen();
+    if (!Val)
+      return nullptr;
+
+    AllocaInst *Variable = NamedValues.lookup(LHSE->getName());
+    if (!Variable)
+      return LogErrorV("Unknown variable name");
+    if (Val->getType() != Variable->getAllocatedType())
+      return LogErrorV("assigned value does not match the variable's type");
+    Builder->CreateStore(Val, Variable);
+    return Val;
+  }
+
+  // A comparison stays an i1 while it feeds a branch or select (see
+  // codegenCond); it is only widened to 0.0 or 1.0 where the value escapes.
+  if (getComparePredicate(Op) != CmpInst::BAD_FCMP_PREDICATE) {
+    Value *Cond = codegenCond("cmptmp");
+    if (!Cond)
+      return nullptr;
+    return Builder->CreateUIToFP(Cond, Type::getDoubleTy(*TheContext),
+                                 "booltmp");
+  }
+
+  Value *L = LHS->codegen();
+  Value *R = RHS->codegen();
+  if (!L || !R)
+    return nullptr;
+  if (!isDouble(L) || !isDouble(R))
+    return LogErrorV("operands of an operator must be numbers");
+  switch (Op) {
+  case '+':
+    return Builder->CreateFAdd(L, R, "addtmp");
+  case '-':
+    return Builder->CreateFSub(L, R, "subtmp");
+  case '*':
+    return Builder->CreateFMul(L, R, "multmp");
+  case '/':
+    return Builder->CreateFDiv(L, R, "divtmp");
+  default:
+    break;
+  }
+
+  // If it wasn't a builtin binary operator, it must be a user defined one.
+  // Emit a call to it.
+  Function *F = getFunction(std::string("binary") + char(Op));
+  if (!F)
+    return LogErrorV("invalid binary operator");
+
+  Value *Ops[2] = {L, R};
+  return Builder->CreateCall(F, Ops, "binop");
+}
+
+/// getMathIntrinsic - The intrinsic that a call of the builtin math function
+/// Name with NumArgs arguments lowers to, or not_intrinsic if there is none.
+static Intrinsic::ID getMathIntrinsic(StringRef Name, size_t NumArgs) {
+  auto [ID, Arity] =
+      StringSwitch<std::pair<Intrinsic::ID, size_t>>(Name)
+          .Case("sqrt", {Intrinsic::sqrt, 1})
+          .Case("sin", {Intrinsic::sin, 1})
+          .Case("cos", {Intrinsic::cos, 1})
+          .Case("exp", {Intrinsic::exp, 1})
+          .Case("exp2", {Intrinsic::exp2, 1})
+          .Case("log", {Intrinsic::log, 1})
+          .Case("log2", {Intrinsic::log2, 1})
+          .Case("log10", {Intrinsic::log10, 1})
+          .Case("fabs", {Intrinsic::fabs, 1})
+          .Case("floor", {Intrinsic::floor, 1})
+          .Case("ceil", {Intrinsic::ceil, 1})
+          .Case("round", {Intrinsic::round, 1})
+          .Case("trunc", {Intrinsic::trunc, 1})
+          .Case("pow", {Intrinsic::pow, 2})
+          .Case("fmin", {Intrinsic::minnum, 2})
+          .Case("fmax", {Intrinsic::maxnum, 2})
+          .Case("fma", {Intrinsic::fma, 3})
+          .Default({Intrinsic::not_intrinsic, 0});
+  return Arity == NumArgs ? ID : Intrinsic::not_intrinsic;
+}
+
+/// isLibraryFunctionName - Whether LLVM knows Name as a C library function.
+static bool isLibraryFunctionName(StringRef Name) {
+  static const TargetLibraryInfoImpl TLII{Triple(sys::getProcessTriple())};
+  LibFunc F;
+  return TLII.getLibFunc(Name, F);
+}
+
+/// isDefinedFunction - Whether Name is a function the program defines, as
+/// opposed to one it imports.
+static bool isDefinedFunction(const std::string &Name) {
+  auto FI = FunctionProtos.find(Name);
+  return FI != FunctionProtos.end() && !FI->second->isImported();
+}
+
+/// getMathIntrinsicCallee - If a call of Name with NumArgs arguments is to a
+/// builtin math function, the declaration of its intrinsic. The intrinsics
+/// compute what libm does, but LLVM can fold and vectorize them and lower
+/// many to single instructions. Importing the libm function changes nothing;
+/// defining a function of the same name replaces the builtin.
+static Function *getMathIntrinsicCallee(const std::string &Name,
+                                        size_t NumArgs) {
+  Intrinsic::ID ID = getMathIntrinsic(Name, NumArgs);
+  if (ID == Intrinsic::not_intrinsic || isDefinedFunction(Name))
+    return nullptr;
+  return Intrinsic::getDeclaration(TheModule.get(), ID,
+                                   Type::getDoubleTy(*TheContext));
+}
+
+Value *CallExprAST::codegen() {
+  // Look up the name among the builtins, then in the global module table
+  Function *CalleeF = getMathIntrinsicCallee(Callee.str(), Args.size());
+  if (!CalleeF)
+    CalleeF = getFunction(Callee.str());
+  if (!CalleeF)
+    return LogErrorV("Unkown Function referenced");
+
+  // argument mismatch error -> refers to if there are more/less arguments than
+  // expected
+  if (CalleeF->arg_size() != Args.size())
+    return LogErrorV("Incorrect number of arguments passed into function call");
+  std::vector<Value *> ArgsV;
+  for (unsigned i = 0, e = Args.size(); i != e; ++i) {
+    ArgsV.push_back(Args[i]->codegen());
+    if (!ArgsV.back())
+      return nullptr;
+    if (ArgsV.back()->getType() != CalleeF->getArg(i)->getType())
+      return LogErrorV("argument type does not match the function's prototype");
+  }
+  CallInst *Call = Builder->CreateCall(CalleeF, ArgsV, "calltmp");
+  // A definition that happens to share a C library function's name is not
+  // that function; keep LLVM from folding or rewriting calls to it as if it
+  // were.
+  if (isLibraryFunctionName(Callee) && isDefinedFunction(Callee.str()))
+    Call->addFnAttr(Attribute::NoBuiltin);
+  return Call;
+}
+
+Value *IndexExprAST::codegenAddress() {
+  Value *BaseV = Base->codegen();
+  if (!BaseV)
+    return nullptr;
+  if (!BaseV->getType()->isPointerTy())
+    return LogErrorV("only a ptr can be indexed");
+  Value *IndexV = Index->codegen();
+  if (!IndexV)
+    return nullptr;
+  if (!isDouble(IndexV))
+    return LogErrorV("index must be a number");
+
+  // Indices are numbers like everything else; truncate them to an integer.
+  IndexV = Builder->CreateFPToSI(IndexV, Type::getInt64Ty(*TheContext), "idx");
+  return Builder->CreateInBoundsGEP(Type::getDoubleTy(*TheContext), BaseV,
+                                    IndexV, "elemptr");
+}
+
+Value *IndexExprAST::codegen() {
+  Value *Addr = codegenAddress();
+  if (!Addr)
+    return nullptr;
+  return Builder->CreateLoad(Type::getDoubleTy(*TheContext), Addr, "elem");
+}
+
+Value *ExprAST::codegen() {
+  switch (Kind) {
+  case EK_Number:
+    return cast<NumberExprAST>(this)->codegen();
+  case EK_Variable:
+    return cast<VariableExprAST>(this)->codegen();
+  case EK_Binary:
+    return cast<BinaryExprAST>(this)->codegen();
+  case EK_Call:
+    return cast<CallExprAST>(this)->codegen();
+  case EK_If:
+    return cast<IfExprAST>(this)->codegen();
+  case EK_For:
+    return cast<ForExprAST>(this)->codegen();
+  case EK_Var:
+    return cast<VarExprAST>(this)->codegen();
+  case EK_Index:
+    return cast<IndexExprAST>(this)->codegen();
+  }
+  llvm_unreachable("unknown expression kind");
+}
+
+Value *ExprAST::codegenCond(const Twine &Name) {
+  if (auto *B = dyn_cast<BinaryExprAST>(this))
+    return B->codegenCond(Name);
+  return codegenValueCond(Name);
+}
+
+/// appendBlock - Add BB, created without a parent, at the end of F.
+static void appendBlock(Function *F, BasicBlock *BB) {
+#if LLVM_VERSION_MAJOR >= 16
+  F->insert(F->end(), BB);
+#else
+  F->getBasicBlockList().push_back(BB);
+#endif
+}
+
+/// isSpeculatable - Whether E is cheap enough, and free of side effects, to
+/// evaluate whether or not its value is used.
+static bool isSpeculatable(ExprAST *E) {
+  return isa<NumberExprAST>(E) || isa<VariableExprAST>(E);
+}
+
+Value *IfExprAST::codegen() {
+  Value *CondV = Cond->codegenCond("ifcond");
+  if (!CondV)
+    return nullptr;
+
+  // Choosing between two plain values needs no control flow.
+  if (isSpeculatable(Then) && isSpeculatable(Else)) {
+    Value *ThenV = Then->codegen();
+    Value *ElseV = Else->codegen();
+    if (!ThenV || !ElseV)
+      return nullptr;
+    if (ThenV->getType() != ElseV->getType())
+      return LogErrorV("'then' and 'else' must have the same type");
+    return Builder->CreateSelect(CondV, ThenV, ElseV, "iftmp");
+  }
+
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+
+  // Create blocks for the then and else cases. Insert the 'then' block at the
+  // end of the function.
+  BasicBlock *ThenBB = BasicBlock::Create(*TheContext, "then", TheFunction);
+  BasicBlock *ElseBB = BasicBlock::Create(*TheContext, "else");
+  BasicBlock *MergeBB = BasicBlock::Create(*TheContext, "ifcont");
+
+  Builder->CreateCondBr(CondV, ThenBB, ElseBB);
+
+  // Emit then value.
+  Builder->SetInsertPoint(ThenBB);
+  Value *ThenV = Then->codegen();
+  if (!ThenV)
+    return nullptr;
+  Builder->CreateBr(MergeBB);
+  // Codegen of 'Then' can change the current block, update ThenBB for the PHI.
+  ThenBB = Builder->GetInsertBlock();
+
+  // Emit else block.
+  appendBlock(TheFunction, ElseBB);
+  Builder->SetInsertPoint(ElseBB);
+  Value *ElseV = Else->codegen();
+  if (!ElseV)
+    return nullptr;
+  if (ThenV->getType() != ElseV->getType())
+    return LogErrorV("'then' and 'else' must have the same type");
+  Builder->CreateBr(MergeBB);
+  // Codegen of 'Else' can change the current block, update ElseBB for the PHI.
+  ElseBB = Builder->GetInsertBlock();
+
+  // Emit merge block.
+  appendBlock(TheFunction, MergeBB);
+  Builder->SetInsertPoint(MergeBB);
+  PHINode *PN = Builder->CreatePHI(ThenV->getType(), 2, "iftmp");
+  PN->addIncoming(ThenV, ThenBB);
+  PN->addIncoming(ElseV, ElseBB);
+  return PN;
+}
+
+/// ForExprAST::codegen - Emit the loop guarded and rotated, the shape the
+/// loop passes expect. The loop variable lives in a stack slot so that the
+/// body can assign to it; mem2reg turns the slot into the induction phi.
+///
+///   entry:     i = start; if (end) goto loop; else goto afterloop
+///   loop:      body; i = i + step
+///              if (end) goto loop; else goto afterloop
+///   afterloop: ...
+Value *ForExprAST::codegen() {
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+
+  // Create an alloca for the variable in the entry block.
+  AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName,
+                                              Type::getDoubleTy(*TheContext));
+
+  // Emit the start code first, without 'variable' in scope.
+  Value *StartVal = Start->codegen();
+  if (!StartVal)
+    return nullptr;
+  if (!isDouble(StartVal))
+    return LogErrorV("loop variable must be a number");
+  Builder->CreateStore(StartVal, Alloca);
+
+  // Within the loop, the variable shadows any existing one of that name.
+  SymbolScope Scope(NamedValues);
+  NamedValues.insert(VarName, Alloca);
+
+  auto *Zero = ConstantFP::get(*TheContext, APFloat(0.0));
+  Value *GuardCond = End->codegenCond("loopguard");
+  if (!GuardCond)
+    return nullptr;
+  BasicBlock *LoopBB = BasicBlock::Create(*TheContext, "loop", TheFunction);
+  BasicBlock *AfterBB = BasicBlock::Create(*TheContext, "afterloop");
+  Builder->CreateCondBr(GuardCond, LoopBB, AfterBB);
+  Builder->SetInsertPoint(LoopBB);
+
+  // Emit the body of the loop. Like any expression it computes a value, but
+  // the value is thrown away.
+  if (!Body->codegen())
+    return nullptr;
+
+  // If not specified, use 1.0.
+  Value *StepVal =
+      Step ? Step->codegen() : ConstantFP::get(*TheContext, APFloat(1.0));
+  if (!StepVal)
+    return nullptr;
+  if (!isDouble(StepVal))
+    return LogErrorV("loop step must be a number");
+
+  // Reload, increment, and restore the alloca. This handles the case where
+  // the body of the loop mutates the variable.
+  Value *CurVar = Builder->CreateLoad(Alloca->getAllocatedType(), Alloca,
+                                      VarName);
+  Value *NextVar = Builder->CreateFAdd(CurVar, StepVal, "nextvar");
+  Builder->CreateStore(NextVar, Alloca);
+
+  Value *EndCond = End->codegenCond("loopcond");
+  if (!EndCond)
+    return nullptr;
+  Builder->CreateCondBr(EndCond, LoopBB, AfterBB);
+
+  appendBlock(TheFunction, AfterBB);
+  Builder->SetInsertPoint(AfterBB);
+
+  // for expr always returns 0.0.
+  return Zero;
+}
+
+Value *VarExprAST::codegen() {
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+
+  // The new variables shadow outer ones until the end of the body.
+  SymbolScope Scope(NamedValues);
+
+  // Register all variables and emit their initializer.
+  for (auto &[VarName, Init] : VarNames) {
+    // Emit the initializer before adding the variable to scope, this prevents
+    // the initializer from referencing the variable itself, and permits stuff
+    // like this:
+    //  var a = 1 in
+    //    var a = a in ...   # refers to outer 'a'.
+    Value *InitVal = Init ? Init->codegen()
+                          : ConstantFP::get(*TheContext, APFloat(0.0));
+    if (!InitVal)
+      return nullptr;
+
+    AllocaInst *Alloca =
+        CreateEntryBlockAlloca(TheFunction, VarName, InitVal->getType());
+    Builder->CreateStore(InitVal, Alloca);
+    NamedValues.insert(VarName, Alloca);
+  }
+
+  // Codegen the body, now that all vars are in scope.
+  return Body->codegen();
+}
+
+//----------> Code gen for function prototypes <----------//
+Function *PrototypeAST::codegen() {
+  // Make the function type:  double(double,double) etc.
+  std::vector<Type *> Params;
+  for (ValueType Ty : ArgTypes)
+    Params.push_back(getLLVMType(Ty));
+  FunctionType *FT = FunctionType::get(getLLVMType(RetType), Params, false);
+  Function *F =
+      Function::Create(FT, Function::ExternalLinkage, Name, TheModule.get());
+  unsigned Idx = 0;
+  for (auto &Arg : F->args())
+    Arg.setName(Args[Idx++]);
+  return F;
+}
+
+/// isStraightLineArithmetic - Whether F is a single block whose only calls are
+/// to intrinsics the vectorizer can widen.
+static bool isStraightLineArithmetic(const Function &F) {
+  if (F.size() != 1)
+    return false;
+  return llvm::none_of(F.getEntryBlock(), [](const Instruction &I) {
+    auto *CI = dyn_cast<CallInst>(&I);
+    if (!CI)
+      return false;
+    Function *Callee = CI->getCalledFunction();
+    return !Callee || !isTriviallyVectorizable(Callee->getIntrinsicID());
+  });
+}
+
+/// codegenBatchKernel - Emit "void F_batch(const double *a0, ..., double *out,
+/// size_t n)", which evaluates F over n rows of columnar input:
+///
+///   for (size_t i = 0; i != n; ++i) out[i] = F(a0[i], ...);
+///
+/// F's body is inlined into the loop and the columns are noalias. When the
+/// body is straight-line arithmetic, the loop is also tagged
+/// llvm.loop.vectorize.enable so it comes out of the optimizer as straight
+/// SIMD code; forcing a loop with calls or branches in it would only earn a
+/// "loop not vectorized" remark.
+static Function *codegenBatchKernel(Function *F) {
+  Type *DoubleTy = Type::getDoubleTy(*TheContext);
+  Type *PtrTy = PointerType::getUnqual(DoubleTy);
+  Type *SizeTy = TheModule->getDataLayout().getIntPtrType(*TheContext);
+
+  std::vector<Type *> Params(F->arg_size() + 1, PtrTy);
+  Params.push_back(SizeTy);
+  FunctionType *FT =
+      FunctionType::get(Type::getVoidTy(*TheContext), Params, false);
+  Function *K = Function::Create(FT, Function::ExternalLinkage,
+                                 F->getName() + "_batch", TheModule.get());
+
+  unsigned NumCols = F->arg_size();
+  for (unsigned I = 0; I != NumCols; ++I) {
+    K->getArg(I)->setName(F->getArg(I)->getName());
+    K->getArg(I)->addAttr(Attribute::ReadOnly);
+  }
+  Argument *Out = K->getArg(NumCols), *N = K->getArg(NumCols + 1);
+  Out->setName("out");
+  N->setName("n");
+  for (unsigned I = 0; I != NumCols + 1; ++I) {
+    K->getArg(I)->addAttr(Attribute::NoAlias);
+    K->getArg(I)->addAttr(Attribute::NoCapture);
+  }
+
+  BasicBlock *Entry = BasicBlock::Create(*TheContext, "entry", K);
+  BasicBlock *Loop = BasicBlock::Create(*TheContext, "loop", K);
+  BasicBlock *Exit = BasicBlock::Create(*TheContext, "exit", K);
+
+  Builder->SetInsertPoint(Entry);
+  Value *Zero = ConstantInt::get(SizeTy, 0);
+  Builder->CreateCondBr(Builder->CreateICmpEQ(N, Zero, "empty"), Exit, Loop);
+
+  Builder->SetInsertPoint(Loop);
+  PHINode *Idx = Builder->CreatePHI(SizeTy, 2, "i");
+  Idx->addIncoming(Zero, Entry);
+  std::vector<Value *> Row;
+  for (unsigned I = 0; I != NumCols; ++I) {
+    Value *Ptr = Builder->CreateInBoundsGEP(DoubleTy, K->getArg(I), Idx);
+    Row.push_back(Builder->CreateLoad(DoubleTy, Ptr, K->getArg(I)->getName()));
+  }
+  CallInst *Call = Builder->CreateCall(F, Row, "row");
+  Builder->CreateStore(Call, Builder->CreateInBoundsGEP(DoubleTy, Out, Idx));
+  Value *Next = Builder->CreateAdd(Idx, ConstantInt::get(SizeTy, 1), "i.next",
+                                   /*HasNUW=*/true);
+  Idx->addIncoming(Next, Loop);
+  BranchInst *Latch =
+      Builder->CreateCondBr(Builder->CreateICmpEQ(Next, N, "done"), Exit, Loop);
+
+  // Tag the loop for the vectorizer. The loop ID must refer to itself.
+  if (isStraightLineArithmetic(*F)) {
+    MDNode *Enable = MDNode::get(
+        *TheContext,
+        {MDString::get(*TheContext, "llvm.loop.vectorize.enable"),
+         ConstantAsMetadata::get(ConstantInt::getTrue(*TheContext))});
+    MDNode *LoopID = MDNode::getDistinct(*TheContext, {nullptr, Enable});
+    LoopID->replaceOperandWith(0, LoopID);
+    Latch->setMetadata(LLVMContext::MD_loop, LoopID);
+  }
+
+  Builder->SetInsertPoint(Exit);
+  Builder->CreateRetVoid();
+
+  // Inline the scalar body so the loop contains nothing but arithmetic.
+  InlineFunctionInfo IFI;
+  InlineFunction(*Call, IFI);
+
+  verifyFunction(*K);
+  {
+    TimePhase Optimizing(PhaseOptimize, K->getName());
+    TheFPM->run(*K, *TheFAM);
+  }
+  return K;
+}
+
+/// markTailCalls - Mark every self-recursive call of F that is in tail
+/// position musttail. The backend then reuses the caller's frame even at -O0,
+/// and TailCallElim turns the recursion into a loop when optimizing.
+///
+/// An if/else joins its arms in a block that only returns a phi; the return
+/// is first copied into the arms, so that a call ending either arm is
+/// directly followed by a ret.
+static void markTailCalls(Function &F) {
+  SmallVector<ReturnInst *, 4> Worklist, Rets;
+  for (auto &BB : F)
+    if (auto *Ret = dyn_cast<ReturnInst>(BB.getTerminator()))
+      Worklist.push_back(Ret);
+
+  while (!Worklist.empty()) {
+    ReturnInst *Ret = Worklist.pop_back_val();
+    BasicBlock *BB = Ret->getParent();
+    auto *PN = dyn_cast_or_null<PHINode>(Ret->getReturnValue());
+    if (!PN || &BB->front() != PN || PN->getNextNode() != Ret) {
+      Rets.push_back(Ret);
+      continue;
+    }
+
+    SmallVector<BasicBlock *, 4> Preds(predecessors(BB));
+    for (BasicBlock *Pred : Preds) {
+      auto *Br = dyn_cast<BranchInst>(Pred->getTerminator());
+      if (!Br || Br->isConditional())
+        continue;
+      Worklist.push_back(ReturnInst::Create(
+          F.getContext(), PN->getIncomingValueForBlock(Pred), Br));
+      Br->eraseFromParent();
+      PN->removeIncomingValue(Pred, /*DeletePHIIfEmpty=*/false);
+    }
+    if (pred_empty(BB))
+      BB->eraseFromParent();
+    else
+      Rets.push_back(Ret);
+  }
+
+  for (ReturnInst *Ret : Rets) {
+    auto *CI = dyn_cast_or_null<CallInst>(Ret->getReturnValue());
+    if (CI && CI->getCalledFunction() == &F && CI->getNextNode() == Ret)
+      CI->setTailCallKind(CallInst::TCK_MustTail);
+  }
+}
+
+Function *FunctionAST::codegen() {
+  // Transfer ownership of the prototype to the FunctionProtos map, but keep a
+  // reference to it for use below. If the definition fails, the prototype it
+  // replaced comes back.
+  auto &P = *Proto;
+  auto ProtoIt = FunctionProtos.try_emplace(P.getName()).first;
+  std::unique_ptr<PrototypeAST> PrevProto = std::move(ProtoIt->second);
+  ProtoIt->second = std::move(Proto);
+  auto RestoreProto = [&] {
+    if (PrevProto)
+      ProtoIt->second = std::move(PrevProto);
+    else
+      FunctionProtos.erase(ProtoIt);
+  };
+  TimePhase Codegen(PhaseCodegen, P.getName());
+  Function *TheFunction = getFunction(P.getName());
+  if (!TheFunction) {
+    RestoreProto();
+    return nullptr;
+  }
+  if (!TheFunction->empty()) {
+    LogError("Function cannot be redefined");
+    RestoreProto();
+    return nullptr;
+  }
+
+  // create a new basic block to start insertion into
+  BasicBlock *BB = BasicBlock::Create(*TheContext, "entry", TheFunction);
+  Builder->SetInsertPoint(BB);
+
+  Value *RetVal;
+  {
+    // Record the function arguments in a fresh scope. It has to be popped
+    // before the function can be erased, as the keys are the argument names.
+    SymbolScope ArgScope(NamedValues);
+    for (auto &Arg : TheFunction->args()) {
+      // Give every argument a stack slot, so that it can be assigned to.
+      AllocaInst *Alloca =
+          CreateEntryBlockAlloca(TheFunction, Arg.getName(), Arg.getType());
+      Builder->CreateStore(&Arg, Alloca);
+      NamedValues.insert(Arg.getName(), Alloca);
+    }
+    RetVal = Body->codegen();
+  }
+
+  if (RetVal && RetVal->getType() != TheFunction->getReturnType()) {
+    LogError(P.getName() == "__anon_expr"
+                 ? "top-level expression must be a number"
+                 : "function body does not match its return type");
+    RetVal = nullptr;
+  }
+
+  if (RetVal) {
+    // Finish da function
+    Builder->CreateRet(RetVal);
+    markTailCalls(*TheFunction);
+    if (isCollectingStats() && P.getName() != "__anon_expr")
+      instrumentFunctionStats(*TheFunction, P.getName());
+
+    // validate the generated code
+    {
+      TimePhase Verifying(PhaseVerify, P.getName());
+      verifyFunction(*TheFunction);
+    }
+
+    // Optimize the function, unless the JIT will do it on first call (see
+    // LazyOptimizer) or it starts out at tier 0 (see -tiered).
+    if (!isLazyDefinition(P) && !(isTiered() && P.getName() != "__anon_expr")) {
+      TimePhase Optimizing(PhaseOptimize, P.getName());
+      TheFPM->run(*TheFunction, *TheFAM);
+    }
+
+    if (hasBatchKernel(P))
+      codegenBatchKernel(TheFunction);
+    return TheFunction;
+  }
+  // Error reading body, remove function.
+  TheFunction->eraseFromParent();
+  RestoreProto();
+  return nullptr;
+}
+//= == -- -- -- -- -- -- -- -- -- -- -- -- -- -- -- -- -- -- -- -- -- -- -- --
+//-- -- -- -- -- -- -- -- -- -- --==
+//
+// Top-Level parsing and JIT Driver
+//===----------------------------------------------------------------------===//
+
+/// buildFunctionPipeline - Add the per-function passes for the requested
+/// optimization level to FPM. -O0 leaves the IRBuilder output untouched.
+static void buildFunctionPipeline(FunctionPassManager &FPM) {
+  if (OptLevel >= '1') {
+    // Promote allocas to registers.
+    FPM.addPass(PromotePass());
+    // Do simple "peephole" optimizations and bit-twiddling optzns.
+    FPM.addPass(InstCombinePass());
+    // Simplify the control flow graph (deleting unreachable blocks, etc).
+    FPM.addPass(SimplifyCFGPass());
+    // Turn self-recursive tail calls into loops.
+    FPM.addPass(TailCallElimPass());
+  }
+  if (OptLevel >= '2') {
+    // Reassociate expressions.
+    FPM.addPass(ReassociatePass());
+    // Eliminate Common SubExpressions.
+    FPM.addPass(GVNPass());
+    // Clean up after reassociation and GVN.
+    FPM.addPass(InstCombinePass());
+    FPM.addPass(SimplifyCFGPass());
+    // Canonicalize induction variables (integer-valued floating point ones
+    // become integers, giving a computable trip count) and drop dead loops.
+    LoopPassManager LPM;
+    LPM.addPass(IndVarSimplifyPass());
+    LPM.addPass(LoopDeletionPass());
+    FPM.addPass(createFunctionToLoopPassAdaptor(std::move(LPM)));
+    // Vectorize loops the target can profit from, or that ask for it.
+    FPM.addPass(LoopVectorizePass());
+    FPM.addPass(InstCombinePass());
+    FPM.addPass(SimplifyCFGPass());
+    // Unroll what is left of small loops with known trip counts.
+    FPM.addPass(LoopUnrollPass(LoopUnrollOptions(OptLevel - '0')));
+    FPM.addPass(InstCombinePass());
+  }
+  if (OptLevel >= '3') {
+    // Pick up redundancies exposed by the second round of combining.
+    FPM.addPass(EarlyCSEPass());
+    FPM.addPass(InstCombinePass());
+  }
+}
+
+/// registerAnalyses - Register the analyses the pipeline's passes use. TM
+/// supplies the cost model the vectorizer needs.
+static void registerAnalyses(TargetMachine *TM, LoopAnalysisManager &LAM,
+                             FunctionAnalysisManager &FAM,
+                             CGSCCAnalysisManager &CGAM,
+                             ModuleAnalysisManager &MAM) {
+  PassBuilder PB(TM);
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+}
+
+/// MaxInlineImportSize - Definitions of at most this many instructions keep a
+/// copy of their IR for inlining into later definitions' modules.
+static constexpr unsigned MaxInlineImportSize = 64;
+
+/// InlineBodyMap - Bitcode of small functions, by name.
+using InlineBodyMap = StringMap<SmallVector<char, 0>>;
+
+/// InlineBodies - The small functions defined so far. Every definition gets
+/// its own module, so this is how a later caller can still see (and inline)
+/// a helper whose code is already in the JIT.
+static thread_local InlineBodyMap InlineBodies;
+
+/// recordInlineBody - Keep F's IR for importInlineBodies if F is small. A
+/// definition that may be replaced later must not be inlined, so nothing is
+/// kept under -redefine. Only the JIT imports bodies; when emitting a file,
+/// every definition already shares TheModule.
+static void recordInlineBody(Function &F) {
+  if (!TheJIT || OptLevel < '2' || isRedefinable() ||
+      F.getInstructionCount() > MaxInlineImportSize)
+    return;
+  // Keep F alone, with declarations of what it refers to rather than the
+  // rest of its module.
+  ValueToValueMapTy VMap;
+  std::unique_ptr<Module> Body = CloneModule(
+      *F.getParent(), VMap, [&](const GlobalValue *GV) { return GV == &F; });
+  for (auto &G : make_early_inc_range(Body->functions()))
+    if (G.isDeclaration() && G.use_empty())
+      G.eraseFromParent();
+
+  // Skip the symbol table WriteBitcodeToFile would add; only the IR is
+  // needed here, and building the table costs more than the module.
+  auto &Buf = InlineBodies[F.getName()];
+  Buf.clear();
+  BitcodeWriter Writer(Buf);
+  Writer.writeModule(*Body);
+  Writer.writeStrtab();
+}
+
+/// importInlineBodies - Give every function M declares and Bodies has an
+/// available_externally definition in M, so the inliner can use it while the
+/// JIT keeps calling the real one.
+static void importInlineBodies(Module &M, const InlineBodyMap &Bodies) {
+  SmallVector<std::string, 8> Callees;
+  for (auto &F : M)
+    if (F.isDeclaration() && Bodies.count(F.getName()))
+      Callees.push_back(F.getName().str());
+
+  for (auto &Name : Callees) {
+    const auto &Buf = Bodies.find(Name)->second;
+    auto Src = parseBitcodeFile(
+        MemoryBufferRef(StringRef(Buf.data(), Buf.size()), Name),
+        M.getContext());
+    if (!Src) {
+      consumeError(Src.takeError());
+      continue;
+    }
+    if (Linker::linkModules(M, std::move(*Src), Linker::LinkOnlyNeeded))
+      continue;
+    if (auto *F = M.getFunction(Name))
+      if (!F->isDeclaration())
+        F->setLinkage(GlobalValue::AvailableExternallyLinkage);
+  }
+}
+
+/// hasDefinedCallee - Whether any function in M calls one M defines.
+static bool hasDefinedCallee(Module &M) {
+  for (auto &F : M)
+    if (!F.isDeclaration())
+      for (auto *U : F.users())
+        if (isa<CallInst>(U))
+          return true;
+  return false;
+}
+
+/// optimizeModule - At -O2 and up, run the interprocedural pipeline over a
+/// module whose definitions are complete: import small helpers defined
+/// earlier from Bodies, propagate constants, inline, re-simplify the callers,
+/// and drop whatever imported or internal function is no longer referenced.
+/// Returns false, leaving M alone, when there is no call that could be
+/// inlined.
+static bool optimizeModule(Module &M, TargetMachine *TM,
+                           const InlineBodyMap &Bodies) {
+  if (OptLevel < '2')
+    return false;
+  TimePhase Optimizing(PhaseOptimize, M.getModuleIdentifier());
+  importInlineBodies(M, Bodies);
+  if (!hasDefinedCallee(M))
+    return false;
+
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+  registerAnalyses(TM, LAM, FAM, CGAM, MAM);
+
+  FunctionPassManager FPM;
+  buildFunctionPipeline(FPM);
+  ModuleInlinerWrapperPass Inliner(getInlineParams(OptLevel - '0', 0));
+  Inliner.getPM().addPass(createCGSCCToFunctionPassAdaptor(std::move(FPM)));
+
+  ModulePassManager MPM;
+  MPM.addPass(IPSCCPPass());
+  MPM.addPass(std::move(Inliner));
+  MPM.addPass(EliminateAvailableExternallyPass());
+  MPM.addPass(GlobalDCEPass());
+  MPM.run(M, MAM);
+  return true;
+}
+
+/// optimizeModule - Likewise, for this thread's target and inline bodies.
+static bool optimizeModule(Module &M) {
+  return optimizeModule(M, TheTargetMachine.get(), InlineBodies);
+}
+
+static void InitializeModule(StringRef ModuleName = "my cool jit") {
+  // Open a new context and module. Whatever was still built in the old
+  // context has to go before the context does.
+  TheModule.reset();
+  TheContext = std::make_unique<LLVMContext>();
+  TheModule = std::make_unique<Module>(ModuleName, *TheContext);
+  if (TheJIT) {
+    TheModule->setDataLayout(TheJIT->getDataLayout());
+  } else {
+    TheModule->setDataLayout(TheTargetMachine->createDataLayout());
+    TheModule->setTargetTriple(TheTargetMachine->getTargetTriple().str());
+  }
+
+  // Create a new builder for the module.
+  Builder = std::make_unique<IRBuilder<>>(*TheContext);
+  Builder->setFastMathFlags(getFastMathFlags());
+
+  // Create new pass and analysis managers.
+  TheFPM = std::make_unique<FunctionPassManager>();
+  TheLAM = std::make_unique<LoopAnalysisManager>();
+  TheFAM = std::make_unique<FunctionAnalysisManager>();
+  TheCGAM = std::make_unique<CGSCCAnalysisManager>();
+  TheMAM = std::make_unique<ModuleAnalysisManager>();
+  buildFunctionPipeline(*TheFPM);
+  registerAnalyses(TheTargetMachine.get(), *TheLAM, *TheFAM, *TheCGAM,
+                   *TheMAM);
+}
+
+/// optimizeUnoptimizedModule - Run the whole pipeline over M, whose functions
+/// have not been through the per-function passes yet.
+static void optimizeUnoptimizedModule(Module &M, TargetMachine *TM,
+                                      const InlineBodyMap &Bodies) {
+  if (optimizeModule(M, TM, Bodies))
+    return;
+  TimePhase Optimizing(PhaseOptimize, M.getModuleIdentifier());
+  FunctionPassManager FPM;
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+  buildFunctionPipeline(FPM);
+  registerAnalyses(TM, LAM, FAM, CGAM, MAM);
+  for (auto &F : M)
+    if (!F.isDeclaration())
+      FPM.run(F, FAM);
+}
+
+/// LazyOptimizer - The JIT's optimizer transform under -lazy: run the
+/// pipeline over the functions about to be compiled. It runs on whichever
+/// thread first calls them, such as an evaluateParallel worker that has none
+/// of the compiling thread's state, so the target and the inline bodies are
+/// handed to it up front and it builds its own pass managers. Bodies is only
+/// added to between top-level items, while no JIT'd code is running.
+class LazyOptimizer {
+  std::unique_ptr<TargetMachine> TM;
+  const InlineBodyMap &Bodies;
+  // TM caches its subtargets as it is used, so only one thread may use it.
+  std::mutex Lock;
+
+public:
+  LazyOptimizer(std::unique_ptr<TargetMachine> TM, const InlineBodyMap &Bodies)
+      : TM(std::move(TM)), Bodies(Bodies) {}
+
+  Expected<orc::ThreadSafeModule>
+  operator()(orc::ThreadSafeModule TSM, orc::MaterializationResponsibility &) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    TSM.withModuleDo(
+        [&](Module &M) { optimizeUnoptimizedModule(M, TM.get(), Bodies); });
+    return TSM;
+  }
+};
+
+/// addDefinitionModule - Hand a module of definitions to the JIT, to be
+/// compiled function by function on first call under -lazy.
+static void addDefinitionModule(orc::ThreadSafeModule TSM) {
+  TimePhase JITing(PhaseJIT);
+  ExitOnErr(LazyCompile ? TheJIT->addLazyModule(std::move(TSM))
+                        : TheJIT->addModule(std::move(TSM)));
+}
+
+/// shouldPrintIR - Whether to echo the IR of each item as it is compiled.
+static bool shouldPrintIR() {
+  if (PrintIR.getNumOccurrences())
+    return PrintIR;
+  return Emit == EmitKind::JIT;
+}
+
+/// getDefinitionCacheKey - Name the -cache-dir entry of a definition whose
+/// tokens hashed to SourceHash. The operators in effect (their precedence
+/// shapes the AST), the imports visible to it, the code generation flags, the
+/// JIT's target and the LLVM version go into the key too, as each changes the
+/// object produced.
+static std::string getDefinitionCacheKey(const Parser &P, MD5 &SourceHash) {
+  P.getOperators().hash(SourceHash);
+  for (const auto &Entry : FunctionProtos)
+    if (Entry.second->isImported())
+      Entry.second->hashSignature(SourceHash);
+  SourceHash.update(StringRef(&OptLevel.getValue(), 1));
+  SourceHash.update(FoldUnsafeMath ? "U" : "u");
+  SourceHash.update(BatchKernels ? "B" : "b");
+  SourceHash.update(isRedefinable() ? "R" : "r");
+  std::string FMF;
+  raw_string_ostream(FMF) << getFastMathFlags();
+  SourceHash.update(FMF);
+  SourceHash.update(TheJIT->getTargetID());
+  SourceHash.update(LLVM_VERSION_STRING);
+  // Earlier definitions may be inlined into this one, so chain in the key of
+  // the one before it.
+  SourceHash.update(PrevDefinitionKey);
+  MD5::MD5Result Result;
+  SourceHash.final(Result);
+  return PrevDefinitionKey = std::string(Result.digest());
+}
+
+/// loadCachedDefinition - Link the cached object for FnAST into the JIT, if
+/// there is one, without code generating the definition. Its inline body, if
+/// it was kept, comes back too, for later definitions to import.
+static bool loadCachedDefinition(const FunctionAST &FnAST, StringRef Key) {
+  auto Obj = TheObjectCache->lookup(Key);
+  if (!Obj)
+    return false;
+
+  const PrototypeAST &Proto = FnAST.getProto();
+  if (auto Body = TheObjectCache->lookup(Key, ".bc")) {
+    StringRef Bitcode = Body->getBuffer();
+    InlineBodies[Proto.getName()].assign(Bitcode.begin(), Bitcode.end());
+  }
+  if (shouldPrintIR())
+    fprintf(stderr, "Read function definition: %s (cached)\n",
+            Proto.getName().c_str());
+  FunctionProtos[Proto.getName()] = std::make_unique<PrototypeAST>(Proto);
+  TheJIT->recordArity(Proto.getName(), Proto.getNumArgs());
+
+  TimePhase JITing(PhaseJIT);
+  ExitOnErr(TheJIT->addObjectFile(std::move(Obj)));
+  return true;
+}
+
+/// DefinitionVersions - Every name defined in the JIT so far, with the
+/// number of its latest compiled version under -redefine or -tiered (0
+/// without stubs).
+static StringMap<unsigned> DefinitionVersions;
+
+/// getRedirectedNames - The symbols a definition of Name adds to the JIT.
+static SmallVector<std::string, 2> getRedirectedNames(StringRef Name,
+                                                      bool HasKernel) {
+  SmallVector<std::string, 2> Names = {Name.str()};
+  if (HasKernel)
+    Names.push_back((Name + "_batch").str());
+  return Names;
+}
+
+/// getImplName - The name Name's Version-th definition is compiled under.
+static std::string getImplName(StringRef Name, unsigned Version) {
+  return (Name + "." + Twine(Version)).str();
+}
+
+/// checkRedefinition - Reject a definition whose signature does not match
+/// the one it replaces, since code compiled against the old prototype could
+/// call it; without -redefine, reject redefinitions altogether.
+static bool checkRedefinition(const PrototypeAST &Proto) {
+  if (!isRedefinable() && DefinitionVersions.count(Proto.getName())) {
+    LogError("Function cannot be redefined");
+    return false;
+  }
+  auto FI = FunctionProtos.find(Proto.getName());
+  if (FI == FunctionProtos.end() || FI->second->hasSameSignature(Proto))
+    return true;
+  LogError("Function cannot be redefined with a different signature");
+  return false;
+}
+
+/// renameForRedefinition - Move the functions a definition of Name added to
+/// M out of the way of the stubs that will call them.
+static void renameForRedefinition(Module &M, StringRef Name, bool HasKernel,
+                                  unsigned Version) {
+  for (auto &Sym : getRedirectedNames(Name, HasKernel))
+    if (auto *F = M.getFunction(Sym))
+      F->setName(getImplName(Sym, Version));
+}
+
+/// redirectDefinition - Point the stubs for Name at its Version-th
+/// definition, which must already be in the JIT.
+static void redirectDefinition(StringRef Name, bool HasKernel,
+                               unsigned Version) {
+  TimePhase JITing(PhaseJIT);
+  for (auto &Sym : getRedirectedNames(Name, HasKernel))
+    ExitOnErr(TheJIT->redirect(Sym, getImplName(Sym, Version)));
+}
+
+//===----------------------------------------------------------------------===//
+// Tiered compilation (-tiered)
+//===----------------------------------------------------------------------===//
+
+/// TieredFunction - A definition compiled at tier 0: its unoptimized IR, from
+/// which it is recompiled once hot, and the counters its code bumps. The
+/// first counter counts calls; each conditional branch, in function order,
+/// then has a pair counting how often it was taken and not taken.
+struct TieredFunction {
+  SmallVector<char, 0> Bitcode;
+  uint64_t *Counters = nullptr;
+  bool HasKernel = false;
+  bool Optimized = false;
+};
+
+static StringMap<TieredFunction> TieredFunctions;
+
+/// ProfileCounters - Backing store of every TieredFunction's counters. It is
+/// never freed, as replaced code may still be running.
+static BumpPtrAllocator ProfileCounters;
+
+/// forEachConditionalBranch - Call Fn on F's conditional branches in order.
+template <typename FnT> static void forEachConditionalBranch(Function &F,
+                                                             FnT Fn) {
+  for (auto &BB : F)
+    if (auto *Br = dyn_cast<BranchInst>(BB.getTerminator()))
+      if (Br->isConditional())
+        Fn(Br);
+}
+
+/// bumpCounter - Emit an increment of the counter at Addr before I.
+static void bumpCounter(Instruction *I, Value *Addr) {
+  IRBuilder<> B(I);
+  addToCounter(B, Addr, B.getInt64(1));
+}
+
+/// instrumentFunction - Make F count its calls and branches into Counters,
+/// which needs getNumCounters(F) entries.
+static void instrumentFunction(Function &F, uint64_t *Counters) {
+  LLVMContext &Ctx = F.getContext();
+  Type *I64 = Type::getInt64Ty(Ctx);
+  Constant *Base = getCounterAddress(Ctx, Counters);
+  bumpCounter(&*F.getEntryBlock().getFirstInsertionPt(), Base);
+
+  uint64_t Next = 1;
+  forEachConditionalBranch(F, [&](BranchInst *Br) {
+    IRBuilder<> B(Br);
+    Value *Index = B.CreateSelect(Br->getCondition(), B.getInt64(Next),
+                                  B.getInt64(Next + 1), "prof.idx");
+    bumpCounter(Br, B.CreateInBoundsGEP(I64, Base, Index, "prof.ptr"));
+    Next += 2;
+  });
+}
+
+/// getNumCounters - The counters instrumentFunction needs for F.
+static size_t getNumCounters(Function &F) {
+  size_t N = 1;
+  forEachConditionalBranch(F, [&](BranchInst *) { N += 2; });
+  return N;
+}
+
+/// applyProfile - Attach the counts gathered by instrumentFunction to F, the
+/// same function before instrumentation, as its entry count and branch
+/// weights. Block frequencies derived from them steer inlining, loop
+/// unrolling and peeling, and code layout.
+static void applyProfile(Function &F, const uint64_t *Counters) {
+  F.setEntryCount(Counters[0]);
+  MDBuilder MDB(F.getContext());
+  const uint64_t *Next = Counters + 1;
+  forEachConditionalBranch(F, [&](BranchInst *Br) {
+    uint64_t Taken = Next[0], NotTaken = Next[1];
+    Next += 2;
+    if (!Taken && !NotTaken)
+      return;
+    // Branch weights are 32 bits wide; keep the ratio.
+    uint64_t Scale = std::max(Taken, NotTaken) / UINT32_MAX + 1;
+    Br->setMetadata(LLVMContext::MD_prof,
+                    MDB.createBranchWeights(uint32_t(Taken / Scale),
+                                            uint32_t(NotTaken / Scale)));
+  });
+}
+
+/// startTier0 - Keep the IR of Name's definition in M for recompiling it,
+/// then instrument F, Name's code in M, to profile it.
+static void startTier0(Module &M, Function &F, StringRef Name,
+                       bool HasKernel) {
+  TieredFunction &TF = TieredFunctions[Name];
+  TF = TieredFunction();
+  TF.HasKernel = HasKernel;
+  BitcodeWriter Writer(TF.Bitcode);
+  Writer.writeModule(M);
+  Writer.writeStrtab();
+
+  size_t NumCounters = getNumCounters(F);
+  TF.Counters = ProfileCounters.Allocate<uint64_t>(NumCounters);
+  std::fill_n(TF.Counters, NumCounters, 0);
+  instrumentFunction(F, TF.Counters);
+}
+
+/// tierUp - Recompile Name's definition with its profile and the full
+/// optimization pipeline, and swap the result in.
+static void tierUp(StringRef Name, TieredFunction &TF) {
+  TF.Optimized = true;
+  auto Ctx = std::make_unique<LLVMContext>();
+  auto M = parseBitcodeFile(
+      MemoryBufferRef(StringRef(TF.Bitcode.data(), TF.Bitcode.size()), Name),
+      *Ctx);
+  if (!M) {
+    logAllUnhandledErrors(M.takeError(), errs(), "warning: ");
+    return;
+  }
+  applyProfile(*(*M)->getFunction(Name), TF.Counters);
+  optimizeUnoptimizedModule(**M, TheTargetMachine.get(), InlineBodies);
+
+  unsigned Version = ++DefinitionVersions[Name];
+  renameForRedefinition(**M, Name, TF.HasKernel, Version);
+  if (shouldPrintIR()) {
+    fprintf(stderr, "Recompiled hot function after %llu calls:",
+            (unsigned long long)TF.Counters[0]);
+    (*M)->getFunction(getImplName(Name, Version))->print(errs());
+    fprintf(stderr, "\n");
+  }
+  {
+    TimePhase JITing(PhaseJIT);
+    ExitOnErr(TheJIT->addModule(
+        orc::ThreadSafeModule(std::move(*M), std::move(Ctx))));
+  }
+  redirectDefinition(Name, TF.HasKernel, Version);
+}
+
+/// tierUpHotFunctions - Recompile every tier 0 definition called at least
+/// -tier-up-threshold times. It runs between top-level items, while no JIT'd
+/// code is executing on this thread.
+static void tierUpHotFunctions() {
+  for (auto &Entry : TieredFunctions) {
+    TieredFunction &TF = Entry.second;
+    if (!TF.Optimized && TF.Counters[0] >= TierUpThreshold)
+      tierUp(Entry.first(), TF);
+  }
+}
+
+/// addCachedDefinition - Compile TheModule, which holds the definition of
+/// Name, file the object and Name's inline body under Key, and link the
+/// object into the JIT. The entry is written now rather than when the JIT
+/// gets to the module, which it never does for a helper that is only ever
+/// inlined.
+static void addCachedDefinition(StringRef Key, StringRef Name) {
+  TimePhase JITing(PhaseJIT);
+  auto Obj = ExitOnErr(TheJIT->compileModule(*TheModule));
+  TheObjectCache->store(Key, Obj->getBuffer());
+  auto Body = InlineBodies.find(Name);
+  if (Body != InlineBodies.end())
+    TheObjectCache->store(
+        Key, StringRef(Body->second.data(), Body->second.size()), ".bc");
+  ExitOnErr(TheJIT->addObjectFile(std::move(Obj)));
+}
+
+static void HandleDefinition(Parser &P) {
+  // Definitions are cached only on the way into the JIT. Instrumented code
+  // has its counters' addresses built in, so it is never cached.
+  bool UseCache =
+      TheObjectCache && TheJIT && !isTiered() && !isCollectingStats();
+  MD5 SourceHash;
+  if (auto FnAST = P.ParseFunDef(UseCache ? &SourceHash : nullptr)) {
+    // Under -redefine and -tiered every definition is compiled under a fresh
+    // name and then swapped in behind the stub callers use.
+    std::string Name = FnAST->getProto().getName();
+    size_t Arity = FnAST->getProto().getNumArgs();
+    bool HasKernel = hasBatchKernel(FnAST->getProto());
+    // A name only counts as defined once its code is in the JIT, so that
+    // a definition that fails to compile can be retried.
+    unsigned Version = 0;
+    if (TheJIT && !checkRedefinition(FnAST->getProto()))
+      return;
+    if (usesStubs())
+      Version = DefinitionVersions.lookup(Name) + 1;
+    // On a miss, the object is filed under CacheKey once compiled. Lazy
+    // compiles cover only the functions called so far, so they are not
+    // cached.
+    std::string CacheKey;
+    if (UseCache) {
+      std::string Key = getDefinitionCacheKey(P, SourceHash);
+      if (loadCachedDefinition(*FnAST, Key)) {
+        DefinitionVersions[Name] = Version;
+        if (Version)
+          redirectDefinition(Name, HasKernel, Version);
+        return;
+      }
+      if (!LazyCompile)
+        CacheKey = std::move(Key);
+    }
+    if (auto *FnIR = FnAST->codegen()) {
+      // Let the definition inline the helpers it calls, then keep it around
+      // for inlining into later definitions in turn.
+      if (TheJIT && !isLazy() && !isTiered())
+        optimizeModule(*TheModule);
+      recordInlineBody(*FnIR);
+      if (isTiered())
+        startTier0(*TheModule, *FnIR, Name, HasKernel);
+      if (Version)
+        renameForRedefinition(*TheModule, Name, HasKernel, Version);
+      if (shouldPrintIR()) {
+        fprintf(stderr, "Read function definition:");
+        FnIR->print(errs());
+        std::string KernelName = Name + "_batch";
+        if (Version)
+          KernelName = getImplName(KernelName, Version);
+        if (auto *Kernel = TheModule->getFunction(KernelName))
+          Kernel->print(errs());
+        fprintf(stderr, "\n");
+      }
+      // When emitting a file, definitions accumulate in TheModule.
+      if (TheJIT) {
+        if (!CacheKey.empty())
+          addCachedDefinition(CacheKey, Name);
+        else
+          addDefinitionModule(orc::ThreadSafeModule(std::move(TheModule),
+                                                    std::move(TheContext)));
+        InitializeModule();
+        TheJIT->recordArity(Name, Arity);
+        DefinitionVersions[Name] = Version;
+        if (Version)
+          redirectDefinition(Name, HasKernel, Version);
+      }
+    }
+  } else {
+    P.synchronize();
+  }
+}
+
+static void HandleExtern(Parser &P) {
+  if (auto ProtoAST = P.ParseImport()) {
+    Function *FnIR;
+    {
+      TimePhase Codegen(PhaseCodegen, ProtoAST->getName());
+      FnIR = ProtoAST->codegen();
+    }
+    if (FnIR) {
+      if (shouldPrintIR()) {
+        fprintf(stderr, "Read extern: ");
+        FnIR->print(errs());
+        fprintf(stderr, "\n");
+      }
+      FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
+    }
+  } else {
+    P.synchronize();
+  }
+}
+
+/// runTopLevelExprs - JIT TheModule, which holds the freshly generated
+/// top-level expressions Names, call them in order and hand each result to
+/// OnResult, then free their code again. Starts a new module for the next
+/// item.
+static void runTopLevelExprs(ArrayRef<std::string> Names,
+                             function_ref<void(double)> OnResult) {
+  optimizeModule(*TheModule);
+
+  // Create a ResourceTracker to track JIT'd memory allocated to our
+  // anonymous expressions -- that way we can free it after executing.
+  auto RT = TheJIT->getMainJITDylib().createResourceTracker();
+  {
+    TimePhase JITing(PhaseJIT);
+    auto TSM =
+        orc::ThreadSafeModule(std::move(TheModule), std::move(TheContext));
+    ExitOnErr(TheJIT->addModule(std::move(TSM), RT));
+    InitializeModule();
+  }
+
+  for (auto &Name : Names) {
+    double (*FP)();
+    {
+      TimePhase JITing(PhaseJIT);
+      // Search the JIT for the expression's symbol, and cast it to the right
+      // type (takes no arguments, returns a double) so we can call it as a
+      // native function.
+      auto ExprSymbol = ExitOnErr(TheJIT->lookup(Name));
+      FP = ExprSymbol.toPtr<double (*)()>();
+    }
+
+    double Result;
+    {
+      TimePhase Executing(PhaseExecute);
+      Result = FP();
+    }
+    OnResult(Result);
+  }
+
+  // Delete the anonymous expression module from the JIT.
+  ExitOnErr(RT->remove());
+
+  if (isTiered())
+    tierUpHotFunctions();
+}
+
+/// runAnonExpr - Run the single __anon_expr in TheModule and return its
+/// value.
+static double runAnonExpr() {
+  double Result = 0;
+  runTopLevelExprs({"__anon_expr"}, [&](double V) { Result = V; });
+  return Result;
+}
+
+/// PendingExprs - The top-level expressions of the current -expr-batch, in
+/// TheModule and in input order, and when the first of them was read.
+static thread_local std::vector<std::string> PendingExprs;
+static thread_local std::chrono::steady_clock::time_point PendingSince;
+
+/// isBatchingExprs - Whether top-level expressions read by P are gathered
+/// into batches. A terminal user wants to see each result right away.
+static bool isBatchingExprs(const Parser &P) {
+  return TheJIT && ExprBatchSize > 1 &&
+         !(P.isInteractive() && sys::Process::StandardInIsUserInput());
+}
+
+/// flushPendingExprs - Compile and run the expressions of the current batch.
+/// Call it before anything else is generated into TheModule.
+static void flushPendingExprs() {
+  if (PendingExprs.empty())
+    return;
+  runTopLevelExprs(PendingExprs, [](double V) {
+    fprintf(stderr, "Evaluated to %f\n", V);
+  });
+  PendingExprs.clear();
+}
+
+/// isPendingBatchDue - Whether the current batch is full or has waited for
+/// -expr-batch-ms.
+static bool isPendingBatchDue() {
+  if (PendingExprs.size() >= ExprBatchSize)
+    return true;
+  return ExprBatchMs && std::chrono::steady_clock::now() - PendingSince >=
+                            std::chrono::milliseconds(ExprBatchMs);
+}
+
+/// runPendingBatchWhenDue - The lexer's idle handler under -expr-batch-ms: run
+/// the pending batch if it has waited long enough, else return how much
+/// longer it may wait.
+static int runPendingBatchWhenDue() {
+  if (PendingExprs.empty())
+    return -1;
+  auto Left = std::chrono::milliseconds(ExprBatchMs) -
+              (std::chrono::steady_clock::now() - PendingSince);
+  if (Left <= std::chrono::milliseconds(0)) {
+    flushPendingExprs();
+    return -1;
+  }
+  return std::chrono::ceil<std::chrono::milliseconds>(Left).count();
+}
+
+static void HandleTopLevelExpression(Parser &P) {
+  // Evaluate a top-level expression into an anonymous function.
+  if (auto FnAST = P.ParseTopLevelExpr()) {
+    if (auto *FnIR = FnAST->codegen()) {
+      // Without a JIT nothing runs; keep the expression in the output under a
+      // unique name instead.
+      if (!TheJIT) {
+        FnIR->setName("__anon_expr." + Twine(AnonExprCount++));
+        if (shouldPrintIR()) {
+          fprintf(stderr, "Read top-level expression:");
+          FnIR->print(errs());
+          fprintf(stderr, "\n");
+        }
+        return;
+      }
+
+      if (!isBatchingExprs(P)) {
+        fprintf(stderr, "Evaluated to %f\n", runAnonExpr());
+        return;
+      }
+
+      // Keep the expression in TheModule under a unique name until its batch
+      // is run.
+      FnIR->setName("__anon_expr." + Twine(AnonExprCount++));
+      if (PendingExprs.empty())
+        PendingSince = std::chrono::steady_clock::now();
+      PendingExprs.push_back(FnIR->getName().str());
+      if (isPendingBatchDue())
+        flushPendingExprs();
+    }
+  } else {
+    P.synchronize();
+  }
+}
+
+/// top ::= definition | external | expression | ';'
+static void MainLoop(Parser &P) {
+  while (true) {
+    // Only prompt when reading interactively from stdin.
+    if (P.isInteractive())
+      fprintf(stderr, "is-> ");
+    switch (P.getCurTok()) {
+    case tok_eof:
+      flushPendingExprs();
+      return;
+    case ';': // ignore top-level semicolons.
+      P.getNextToken();
+      break;
+    case tok_fun: {
+      // Batched expressions run before anything after them.
+      flushPendingExprs();
+      TimeItem Item(ItemDefinition);
+      HandleDefinition(P);
+      break;
+    }
+    case tok_imp: {
+      flushPendingExprs();
+      TimeItem Item(ItemImport);
+      HandleExtern(P);
+      break;
+    }
+    default: {
+      TimeItem Item(ItemTopLevelExpr);
+      HandleTopLevelExpression(P);
+      break;
+    }
+    }
+    // The item has been code generated; free its expression nodes. Its
+    // errors are printed now, next to anything it output when run.
+    P.releaseAST();
+    P.flushDiagnostics();
+  }
+}
+
+//===----------------------------------------------------------------------===//
+// Emitting object, assembly and bitcode files.
+//===----------------------------------------------------------------------===//
 
-    // If BinOp binds less tightly with RHS than the operator after RHS, let
-    // the pending operator take RHS as its LHS.
-    int NextPrec = GetTokPrecedence();
-    if (TokPrec < NextPrec) {
-      RHS = ParseBinOpRHS(TokPrec + 1, std::move(RHS));
-      if (!RHS)
-        return nullptr;
-    }
+/// createHostTargetMachine - Build a TargetMachine for the host, or print an
+/// error and return null.
+static std::unique_ptr<TargetMachine> createHostTargetMachine() {
+  auto TargetTriple = sys::getDefaultTargetTriple();
 
-    // Merge LHS/RHS.
-    LHS =
-        std::make_unique<BinaryExprAST>(BinOp, std::move(LHS), std::move(RHS));
+  std::string Error;
+  auto *Target = TargetRegistry::lookupTarget(TargetTriple, Error);
+  if (!Target) {
+    errs() << "Error: " << Error << "\n";
+    return nullptr;
   }
+
+  std::string CPU = getTargetCPU();
+  TargetOptions Opt;
+  Opt.AllowFPOpFusion = getFPOpFusion();
+  return std::unique_ptr<TargetMachine>(Target->createTargetMachine(
+      TargetTriple, CPU.empty() ? "generic" : CPU,
+      getTargetFeatures().getString(), Opt, Reloc::PIC_));
 }
 
-/// expression
-///   ::= primary binoprhs
-///
-static std::unique_ptr<ExprAST> ParseExpression() {
-  auto LHS = ParsePrimary();
-  if (!LHS)
-    return nullptr;
+/// getOutputFilename - The file -emit-* writes for InputFilename: the -o
+/// name if given, otherwise the input with its extension replaced.
+static std::string getOutputFilename(StringRef InputFilename) {
+  if (!OutputFilename.empty())
+    return OutputFilename;
 
-  return ParseBinOpRHS(0, std::move(LHS));
+  StringRef Ext = Emit == EmitKind::Object    ? "o"
+                  : Emit == EmitKind::Bitcode ? "bc"
+                                              : "s";
+  SmallString<128> Path(InputFilename.empty() || InputFilename == "-"
+                            ? StringRef("output")
+                            : InputFilename);
+  sys::path::replace_extension(Path, Ext);
+  return std::string(Path);
 }
 
-// prototype
-///   ::= id '(' id* ')'
-static std::unique_ptr<PrototypeAST> ParsePrototype() {
-  if (CurTok != tok_identifier)
-    return LogErrorP("Expected function name in prototype");
+/// emitModule - Write M to Filename in the selected -emit-* format. Returns
+/// false (after printing an error) on failure.
+static bool emitModule(Module &M, TargetMachine &TM, StringRef Filename) {
+  TimePhase Emitting(PhaseEmit, Filename);
+  std::error_code EC;
+  raw_fd_ostream Dest(Filename, EC,
+                      Emit == EmitKind::Assembly ? sys::fs::OF_Text
+                                                 : sys::fs::OF_None);
+  if (EC) {
+    errs() << "Error: could not open '" << Filename << "': " << EC.message()
+           << "\n";
+    return false;
+  }
+
+  if (Emit == EmitKind::Bitcode) {
+    WriteBitcodeToFile(M, Dest);
+    Dest.flush();
+    return true;
+  }
 
-  std::string FnName = IdentifierStr;
-  getNextToken();
+#if LLVM_VERSION_MAJOR >= 18
+  auto FileType = Emit == EmitKind::Object ? CodeGenFileType::ObjectFile
+                                           : CodeGenFileType::AssemblyFile;
+#else
+  auto FileType = Emit == EmitKind::Object ? CGFT_ObjectFile : CGFT_AssemblyFile;
+#endif
 
-  if (CurTok != '(')
-    return LogErrorP("Expected '(' in prototype");
+  legacy::PassManager Pass;
+  if (TM.addPassesToEmitFile(Pass, Dest, nullptr, FileType)) {
+    errs() << "Error: the target can't emit a file of this type\n";
+    return false;
+  }
+  Pass.run(M);
+  Dest.flush();
+  return true;
+}
 
-  std::vector<std::string> ArgNames;
-  while (getNextToken() == tok_identifier)
-    ArgNames.push_back(IdentifierStr);
-  if (CurTok != ')')
-    return LogErrorP("Expected ')' in prototype");
+//===----------------------------------------------------------------------===//
+// Batch driver: compile several files in parallel.
+//===----------------------------------------------------------------------===//
 
-  // success.
-  getNextToken(); // eat ')'.
+/// CompiledUnit - The result of compiling one input file on a worker thread:
+/// a module holding all of the file's definitions, plus the names of the
+/// anonymous functions wrapping its top-level expressions, in source order.
+struct CompiledUnit {
+  std::string Filename;
+  std::unique_ptr<LLVMContext> Context;
+  std::unique_ptr<Module> M;
+  std::vector<std::string> TopLevelExprs;
+  bool Failed = false;
+};
+
+/// CompileFile - Parse and codegen one file into its own LLVMContext and
+/// Module. Runs on a worker thread, so it only touches thread-local codegen
+/// state. Functions used from other input files must be imported. In the
+/// -emit-* modes the module is also written out here, on the worker.
+static CompiledUnit CompileFile(unsigned UnitIdx, const std::string &Filename) {
+  CompiledUnit Unit;
+  Unit.Filename = Filename;
+
+  auto BufOrErr = MemoryBuffer::getFile(Filename);
+  if (std::error_code EC = BufOrErr.getError()) {
+    fprintf(stderr, "Error: could not open '%s': %s\n", Filename.c_str(),
+            EC.message().c_str());
+    Unit.Failed = true;
+    return Unit;
+  }
+
+  if (!TheTargetMachine) {
+    TheTargetMachine = createHostTargetMachine();
+    if (!TheTargetMachine) {
+      Unit.Failed = true;
+      return Unit;
+    }
+  }
+
+  Lexer Lex(std::move(*BufOrErr));
+  Parser P(Lex);
+  FunctionProtos.clear();
+  InitializeModule(Filename);
+
+  P.getNextToken();
+  while (P.getCurTok() != tok_eof) {
+    switch (P.getCurTok()) {
+    case ';': // ignore top-level semicolons.
+      P.getNextToken();
+      break;
+    case tok_fun: {
+      TimeItem Item(ItemDefinition);
+      if (auto FnAST = P.ParseFunDef()) {
+        const PrototypeAST &Proto = FnAST->getProto();
+        if (FnAST->codegen() && TheJIT)
+          TheJIT->recordArity(Proto.getName(), Proto.getNumArgs());
+      } else {
+        P.synchronize();
+      }
+      break;
+    }
+    case tok_imp: {
+      TimeItem Item(ItemImport);
+      if (auto ProtoAST = P.ParseImport()) {
+        TimePhase Codegen(PhaseCodegen, ProtoAST->getName());
+        if (ProtoAST->codegen())
+          FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
+      } else {
+        P.synchronize();
+      }
+      break;
+    }
+    default: {
+      TimeItem Item(ItemTopLevelExpr);
+      if (auto FnAST = P.ParseTopLevelExpr()) {
+        // Give each expression a name that is unique across all units, since
+        // every unit ends up in the same JITDylib.
+        if (auto *FnIR = FnAST->codegen()) {
+          FnIR->setName("__anon_expr." + Twine(UnitIdx) + "." +
+                        Twine(Unit.TopLevelExprs.size()));
+          Unit.TopLevelExprs.push_back(FnIR->getName().str());
+        }
+      } else {
+        P.synchronize();
+      }
+      break;
+    }
+    }
+    P.releaseAST();
+  }
+
+  FunctionProtos.clear();
+  if (!isLazy())
+    optimizeModule(*TheModule);
+  if (Emit != EmitKind::JIT) {
+    Unit.Failed =
+        !emitModule(*TheModule, *TheTargetMachine, getOutputFilename(Filename));
+    // Free the module before its context, ahead of this worker's next file.
+    TheModule.reset();
+    TheContext.reset();
+    return Unit;
+  }
 
-  return std::make_unique<PrototypeAST>(FnName, std::move(ArgNames));
+  Unit.Context = std::move(TheContext);
+  Unit.M = std::move(TheModule);
+  return Unit;
 }
 
-/// function definition ::= 'fn'
-static std::unique_ptr<FunctionAST> ParseFunDef() {
-  getNextToken(); // eat fn
-  auto Proto = ParsePrototype();
-  if (!Proto)
-    return nullptr;
-  if (auto E = ParseExpression())
-    return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
-  return nullptr;
+/// CompileFilesInParallel - Compile every input file on a pool of worker
+/// threads, then hand the resulting modules to the JIT in command-line order
+/// and run each file's top-level expressions. Returns the process exit code.
+static int CompileFilesInParallel(ArrayRef<std::string> Filenames) {
+  unsigned Jobs = NumJobs ? NumJobs : std::thread::hardware_concurrency();
+  Jobs = std::max(1u, std::min<unsigned>(Jobs, Filenames.size()));
+
+  std::vector<CompiledUnit> Units(Filenames.size());
+  std::atomic<unsigned> NextUnit(0);
+  auto Worker = [&]() {
+    if (!TimeTraceFile.empty())
+      timeTraceProfilerInitialize(TimeTraceGranularity, "isere-worker");
+    for (unsigned I = NextUnit++; I < Filenames.size(); I = NextUnit++)
+      Units[I] = CompileFile(I, Filenames[I]);
+    printTimeReport();
+    if (!TimeTraceFile.empty())
+      timeTraceProfilerFinishThread();
+  };
+
+  std::vector<std::thread> Workers;
+  for (unsigned I = 0; I != Jobs; ++I)
+    Workers.emplace_back(Worker);
+  for (auto &T : Workers)
+    T.join();
+
+  if (Emit != EmitKind::JIT)
+    return llvm::any_of(Units, [](auto &U) { return U.Failed; }) ? 1 : 0;
+
+  // Link everything before running anything, so that cross-file imports
+  // resolve regardless of which worker finished first.
+  int ExitCode = 0;
+  for (auto &Unit : Units) {
+    if (Unit.Failed) {
+      ExitCode = 1;
+      continue;
+    }
+    addDefinitionModule(
+        orc::ThreadSafeModule(std::move(Unit.M), std::move(Unit.Context)));
+  }
+
+  for (auto &Unit : Units) {
+    for (auto &Name : Unit.TopLevelExprs) {
+      double (*FP)();
+      {
+        TimePhase JITing(PhaseJIT);
+        auto ExprSymbol = ExitOnErr(TheJIT->lookup(Name));
+        FP = ExprSymbol.toPtr<double (*)()>();
+      }
+      double Result;
+      {
+        TimePhase Executing(PhaseExecute);
+        Result = FP();
+      }
+      fprintf(stderr, "%s: Evaluated to %f\n", Unit.Filename.c_str(), Result);
+    }
+  }
+  return ExitCode;
 }
-/// import ::= 'import' prototype
-static std::unique_ptr<PrototypeAST> ParseImport() {
-  getNextToken(); // eat Import
-  return ParsePrototype();
+
+//===----------------------------------------------------------------------===//
+// "Library" functions that can be "imported" from user code.
+//===----------------------------------------------------------------------===//
+
+#ifdef _WIN32
+#define DLLEXPORT __declspec(dllexport)
+#else
+#define DLLEXPORT
+#endif
+
+/// putchard - putchar that takes a double and returns 0.
+extern "C" DLLEXPORT double putchard(double X) {
+  fputc((char)X, stderr);
+  return 0;
 }
-/// topLevelexpr ::= expression
-static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
-  if (auto E = ParseExpression()) {
-    // make an anonymous proto
-    auto Proto = std::make_unique<PrototypeAST>("", std::vector<std::string>());
-    return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
-  }
-  return nullptr;
+
+/// printd - printf that takes a double prints it as "%f\n", returning 0.
+extern "C" DLLEXPORT double printd(double X) {
+  fprintf(stderr, "%f\n", X);
+  return 0;
 }
 
-//===-----------------------------------------------------------------------==//
-// CODE GEN
-//===-----------------------------------------------------------------------==//
-static std::unique_ptr<LLVMContext> TheContext;
-static std::unique_ptr<IRBuilder<>> Builder;
-static std::unique_ptr<Module> TheModule;
-static std::map<std::string, Value *> NamedValues;
+/// allocd - Allocate a zeroed buffer of N doubles: "import allocd(n) : ptr".
+extern "C" DLLEXPORT double *allocd(double N) {
+  return static_cast<double *>(calloc(size_t(N), sizeof(double)));
+}
 
-//---- EXPRESSION CODE GEN ----//
-Value *LogErrorV(const char *Str) {
-  LogError(Str);
-  return nullptr;
+/// freed - Free a buffer from allocd, returning 0: "import freed(p : ptr)".
+extern "C" DLLEXPORT double freed(double *P) {
+  free(P);
+  return 0;
 }
 
-Value *NumberExprAST::codegen() {
-  return ConstantFP::get(*TheContext, APFloat(Val));
+/// dumpstats - Write the -function-stats table now, returning 0.
+extern "C" DLLEXPORT double dumpstats() {
+  dumpFunctionStats();
+  return 0;
 }
 
-Value *VariableExprAST::codegen() {
-  // find this variable in the function
-  Value *V = NamedValues[Name];
-  if (!V)
-    LogErrorV("Unknown Variable name");
-  return V;
+//===----------------------------------------------------------------------===//
+// Throughput benchmarks (-bench)
+//===----------------------------------------------------------------------===//
+
+static cl::opt<std::string> BenchOutput(
+    "bench",
+    cl::desc("Measure lexer, parser, codegen and JIT throughput on synthetic "
+             "input instead of compiling, and write the results to <file> "
+             "('-' for stdout) in Google Benchmark's JSON format"),
+    cl::value_desc("file"));
+
+static cl::opt<unsigned>
+    BenchSize("bench-size",
+              cl::desc("Number of definitions in each -bench workload "
+                       "(default = 2000)"),
+              cl::init(2000));
+
+static cl::opt<unsigned> BenchRepetitions(
+    "bench-repetitions",
+    cl::desc("Number of measured runs of each -bench workload, after one "
+             "warm-up run that is not reported (default = 3)"),
+    cl::init(3));
+
+/// BenchTerms - Operands in each synthetic expression of the parse workload.
+static constexpr unsigned BenchTerms = 64;
+
+/// BenchLoopTrips - Iterations of each call in the loop workloads.
+static constexpr unsigned BenchLoopTrips = 1000000;
+
+/// BenchResult - One run of a -bench workload: Items processed in Seconds of
+/// wall time and CPUSeconds of process CPU time.
+struct BenchResult {
+  std::string Name;
+  uint64_t Items = 0;
+  double Seconds = 0;
+  double CPUSeconds = 0;
+};
+
+using BenchClock = std::chrono::steady_clock;
+
+/// cpuSeconds - CPU time used so far by all threads of the process, which
+/// includes the JIT's compile threads.
+static double cpuSeconds() {
+#ifdef _WIN32
+  return double(std::clock()) / CLOCKS_PER_SEC;
+#else
+  timespec TS;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &TS);
+  return TS.tv_sec + TS.tv_nsec * 1e-9;
+#endif
 }
 
-Value *BinaryExprAST::codegen() {
-  Value *L = LHS->codegen();
-  Value *R = RHS->codegen();
-  if (!L || !R)
-    return nullptr;
-  switch (Op) {
-  case '+':
-    return Builder->CreateFAdd(L, R, "addtmp");
-  case '-':
-    return Builder->CreateFSub(L, R, "subtmp");
-  case '*':
-    return Builder->CreateFMul(L, R, "multmp");
-  case '<':
-    L = Builder->CreateFCmpULT(L, R, "cmptmp");
-    // Convert bool 0/1 to double 0.0 or 1.0
-    return Builder->CreateUIToFP(L, Type::getDoubleTy(*TheContext), "booltmp");
-  default:
-    return LogErrorV("invalid binary operator");
+/// BenchTimer - Measures from its construction until stop, which adds the
+/// wall and CPU time taken to a BenchResult.
+class BenchTimer {
+  BenchClock::time_point Wall = BenchClock::now();
+  double CPU = cpuSeconds();
+
+public:
+  void stop(BenchResult &R) const {
+    R.Seconds += std::chrono::duration<double>(BenchClock::now() - Wall).count();
+    R.CPUSeconds += cpuSeconds() - CPU;
+  }
+};
+
+/// makeBenchSource - BenchSize definitions "fn <Prefix><i>(a b c d) ...",
+/// each a chain of Terms operands over the four arguments. Neighbouring
+/// operands differ, so the parser folds nothing away and every body has
+/// exactly 2 * Terms - 1 nodes.
+static std::string makeBenchSource(StringRef Prefix, unsigned Terms) {
+  static const char *const Operands[] = {"a", "b", "c", "d"};
+  static const char *const Ops[] = {" + ", " * ", " - ", " * "};
+  std::string Src;
+  raw_string_ostream OS(Src);
+  for (unsigned I = 0; I != BenchSize; ++I) {
+    OS << "fn " << Prefix << I << "(a b c d) a";
+    for (unsigned T = 1; T != Terms; ++T)
+      OS << Ops[T % 4] << Operands[T % 4];
+    OS << ";\n";
   }
+  return OS.str();
 }
 
-Value *CallExprAST::codegen() {
-  // Look up the name in the global module table
-  Function *CalleeF = TheModule->getFunction(Callee);
-  if (!CalleeF)
-    return LogErrorV("Unkown Function referenced");
+/// benchLexer - Tokens per second through Lexer::getTok.
+static BenchResult benchLexer(StringRef Source) {
+  Lexer Lex(MemoryBuffer::getMemBuffer(Source, "bench", false));
+  BenchResult R{"BM_Lex"};
+  BenchTimer Timer;
+  while (Lex.getTok() != tok_eof)
+    ++R.Items;
+  Timer.stop(R);
+  return R;
+}
 
-  // argument mismatch error -> refers to if there are more/less arguments than
-  // expected
-  if (CalleeF->arg_size() != Args.size())
-    return LogErrorV("Incorrect number of arguments passed into function call");
-  std::vector<Value *> ArgsV;
-  for (unsigned i = 0, e = Args.size(); i != e; ++i) {
-    ArgsV.push_back(Args[i]->codegen());
-    if (!ArgsV.back())
-      return nullptr;
+/// benchParser - Expression nodes per second through Parser::ParseFunDef.
+static BenchResult benchParser(StringRef Source) {
+  Lexer Lex(MemoryBuffer::getMemBuffer(Source, "bench", false));
+  Parser P(Lex);
+  BenchResult R{"BM_Parse"};
+  BenchTimer Timer;
+  P.getNextToken();
+  while (P.getCurTok() == tok_fun) {
+    if (!P.ParseFunDef())
+      break;
+    R.Items += 2 * BenchTerms - 1;
+    P.releaseAST();
+    P.getNextToken(); // eat ';'
   }
-  return Builder->CreateCall(CalleeF, ArgsV, "calltmp");
+  Timer.stop(R);
+  return R;
 }
 
-//----------> Code gen for function prototypes <----------//
-Function *PrototypeAST::codegen() {
-  // Make the function type:  double(double,double) etc.
-  std::vector<Type *> Doubles(Args.size(), Type::getDoubleTy(*TheContext));
-  FunctionType *FT =
-      FunctionType::get(Type::getDoubleTy(*TheContext), Doubles, false);
-  Function *F =
-      Function::Create(FT, Function::ExternalLinkage, Name, TheModule.get());
-  unsigned Idx = 0;
-  for (auto &Arg : F->args())
-    Arg.setName(Args[Idx++]);
-  return F;
+/// benchCodegen - Functions per second through FunctionAST::codegen, which
+/// includes the per-function optimization pipeline.
+static BenchResult benchCodegen(StringRef Source) {
+  Lexer Lex(MemoryBuffer::getMemBuffer(Source, "bench", false));
+  Parser P(Lex);
+  FunctionProtos.clear();
+  InitializeModule("bench");
+  BenchResult R{"BM_Codegen"};
+  P.getNextToken();
+  while (P.getCurTok() == tok_fun) {
+    auto FnAST = P.ParseFunDef();
+    if (!FnAST)
+      break;
+    BenchTimer Timer;
+    if (FnAST->codegen())
+      ++R.Items;
+    Timer.stop(R);
+    P.releaseAST();
+    P.getNextToken(); // eat ';'
+  }
+  FunctionProtos.clear();
+  InitializeModule();
+  return R;
 }
 
-Function *FunctionAST::codegen() {
-  // Check for an existing function from a previous 'import' declaration
-  Function *TheFunction = TheModule->getFunction(Proto->getName());
+/// addBenchDefinitions - Compile the definitions in Source into the JIT,
+/// returning their names. Names must not repeat across calls.
+static std::vector<std::string> addBenchDefinitions(StringRef Source) {
+  Lexer Lex(MemoryBuffer::getMemBuffer(Source, "bench", false));
+  Parser P(Lex);
+  std::vector<std::string> Names;
+  P.getNextToken();
+  while (P.getCurTok() == tok_fun) {
+    auto FnAST = P.ParseFunDef();
+    if (!FnAST)
+      break;
+    Names.push_back(FnAST->getProto().getName());
+    size_t Arity = FnAST->getProto().getNumArgs();
+    if (FnAST->codegen()) {
+      addDefinitionModule(orc::ThreadSafeModule(std::move(TheModule),
+                                                std::move(TheContext)));
+      InitializeModule();
+      TheJIT->recordArity(Names.back(), Arity);
+    }
+    P.releaseAST();
+    P.getNextToken(); // eat ';'
+  }
+  return Names;
+}
 
-  if (!TheFunction)
-    TheFunction = Proto->codegen();
-  if (!TheFunction)
-    return nullptr;
-  if (!TheFunction->empty())
-    return (Function *)LogErrorV("Function cannot be redefined");
+/// benchJIT - Top-level expressions per second, end to end: parse, codegen,
+/// JIT and run "<fn>(1, 2, 3, 4)" for each of the definitions in Source.
+static BenchResult benchJIT(StringRef Source) {
+  std::string Calls;
+  raw_string_ostream OS(Calls);
+  for (auto &Name : addBenchDefinitions(Source))
+    OS << Name << "(1, 2, 3, 4);\n";
 
-  // create a new basic block to start insertion into
-  BasicBlock *BB = BasicBlock::Create(*TheContext, "entry", TheFunction);
-  Builder->SetInsertPoint(BB);
+  Lexer Lex(MemoryBuffer::getMemBuffer(OS.str(), "bench", false));
+  Parser P(Lex);
+  BenchResult R{"BM_JITEval"};
+  BenchTimer Timer;
+  P.getNextToken();
+  while (P.getCurTok() != tok_eof) {
+    auto FnAST = P.ParseTopLevelExpr();
+    if (!FnAST || !FnAST->codegen())
+      break;
+    runAnonExpr();
+    ++R.Items;
+    P.releaseAST();
+    P.getNextToken(); // eat ';'
+  }
+  Timer.stop(R);
+  return R;
+}
 
-  // Record the function arguments in the NamedValues map
-  NamedValues.clear();
-  for (auto &Arg : TheFunction->args())
-    NamedValues[std::string(Arg.getName())] = &Arg;
-  if (Value *RetVal = Body->codegen()) {
-    // Finish da function
-    Builder->CreateRet(RetVal);
+/// benchLoop - Iterations per second of Fn, a one-argument function that
+/// Source defines, run for BenchLoopTrips iterations. Only the call is timed.
+static BenchResult benchLoop(StringRef Name, StringRef Source, StringRef Fn) {
+  addBenchDefinitions(Source);
+  auto *FP = ExitOnErr(TheJIT->lookup(Fn)).toPtr<double (*)(double)>();
+  BenchResult R{Name.str(), BenchLoopTrips};
+  BenchTimer Timer;
+  double Sum = FP(BenchLoopTrips);
+  Timer.stop(R);
+  if (Sum != 0.5 * BenchLoopTrips * (BenchLoopTrips + 1.0))
+    errs() << Name << ": wrong result " << Sum << "\n";
+  return R;
+}
 
-    // validate the generated code
-    verifyFunction(*TheFunction);
-    return TheFunction;
-  }
-  // Error reading body, remove function.
-  TheFunction->eraseFromParent();
-  return nullptr;
+/// benchTailRecursion - A sum written as a self-recursive tail call, which
+/// codegen marks musttail so that it runs as a loop.
+static BenchResult benchTailRecursion(unsigned Run) {
+  std::string Fn = ("tail" + Twine(Run)).str();
+  std::string Source = "fn " + Fn + "acc(n acc) if n < 1 then acc else " + Fn +
+                       "acc(n - 1, acc + n);\nfn " + Fn + "(n) " + Fn +
+                       "acc(n, 0);\n";
+  return benchLoop("BM_TailRecursion", Source, Fn);
 }
-//= == -- -- -- -- -- -- -- -- -- -- -- -- -- -- -- -- -- -- -- -- -- -- -- --
-//-- -- -- -- -- -- -- -- -- -- --==
-//
-// Top-Level parsing and JIT Driver
-//===----------------------------------------------------------------------===//
 
-static void InitializeModule() {
-  // Open a new context and module.
-  TheContext = std::make_unique<LLVMContext>();
-  TheModule = std::make_unique<Module>("my cool jit", *TheContext);
+/// benchForLoop - The sum of benchTailRecursion as a 'for' loop.
+static BenchResult benchForLoop(unsigned Run) {
+  std::string Fn = ("loop" + Twine(Run)).str();
+  std::string Source = "fn " + Fn +
+                       "(n) var acc = 0 in (for i = 1, i < n + 1 in "
+                       "acc = acc + i) + acc;\n";
+  return benchLoop("BM_ForLoop", Source, Fn);
+}
 
-  // Create a new builder for the module.
-  Builder = std::make_unique<IRBuilder<>>(*TheContext);
+/// benchEvaluate - Rows per second through IsereJIT::evaluateParallel over
+/// BenchLoopTrips rows of two columns. With Kernel the function gets a batch
+/// kernel for the chunks to call, and without one they call the scalar
+/// function row by row.
+static BenchResult benchEvaluate(StringRef Name, bool Kernel, unsigned Run,
+                                 orc::WorkStealingPool &Pool) {
+  std::string Fn = ((Kernel ? "kernel" : "scalar") + Twine(Run)).str();
+  {
+    bool HadBatchKernels = BatchKernels;
+    BatchKernels = Kernel;
+    auto Restore = make_scope_exit([&] { BatchKernels = HadBatchKernels; });
+    addBenchDefinitions("fn " + Fn + "(a b) a * b + a;\n");
+  }
+
+  std::vector<double> A(BenchLoopTrips), B(BenchLoopTrips, 2.0),
+      Out(BenchLoopTrips);
+  for (unsigned I = 0; I != BenchLoopTrips; ++I)
+    A[I] = I;
+  // One column short is an error, not a call with garbage arguments.
+  if (!errorToBool(TheJIT->evaluateParallel(Fn, {A.data()}, Out.data(),
+                                            BenchLoopTrips, Pool)))
+    errs() << Name << ": missing column not reported\n";
+  // Compile the function (and its kernel) ahead of the timed call.
+  ExitOnErr(TheJIT->lookup(Fn));
+
+  BenchResult R{Name.str(), BenchLoopTrips};
+  BenchTimer Timer;
+  ExitOnErr(TheJIT->evaluateParallel(Fn, {A.data(), B.data()}, Out.data(),
+                                     BenchLoopTrips, Pool));
+  Timer.stop(R);
+  if (Out.back() != 3.0 * (BenchLoopTrips - 1))
+    errs() << Name << ": wrong result " << Out.back() << "\n";
+  return R;
 }
 
-static void HandleDefinition() {
-  if (auto FnAST = ParseFunDef()) {
-    if (auto *FnIR = FnAST->codegen()) {
-      fprintf(stderr, "Read function definition:");
-      FnIR->print(errs());
-      fprintf(stderr, "\n");
-    }
+/// addBenchRow - Add a row to the Google Benchmark "benchmarks" array, with
+/// times in nanoseconds per item: repetition Index of workload R, or if
+/// Aggregate is given, that statistic (RealNs, CPUNs) over all repetitions.
+static void addBenchRow(json::Array &Rows, const BenchResult &R,
+                        int64_t Family, unsigned Index, double RealNs,
+                        double CPUNs, StringRef Aggregate = "") {
+  json::Object Row{
+      {"name", Aggregate.empty() ? R.Name : R.Name + "_" + Aggregate.str()},
+      {"family_index", Family},
+      {"per_family_instance_index", 0},
+      {"run_name", R.Name},
+      {"run_type", Aggregate.empty() ? "iteration" : "aggregate"},
+      {"repetitions", int64_t(BenchRepetitions)},
+      {"threads", 1},
+      {"iterations", Aggregate.empty() ? int64_t(R.Items)
+                                       : int64_t(BenchRepetitions)},
+      {"real_time", RealNs},
+      {"cpu_time", CPUNs},
+      {"time_unit", "ns"},
+  };
+  if (Aggregate.empty()) {
+    Row["repetition_index"] = int64_t(Index);
+    Row["items_per_second"] = R.Seconds > 0 ? R.Items / R.Seconds : 0;
   } else {
-    // Skip token for error recovery.
-    getNextToken();
+    Row["aggregate_name"] = Aggregate;
+    Row["aggregate_unit"] = "time";
   }
+  Rows.push_back(std::move(Row));
 }
 
-static void HandleExtern() {
-  if (auto ProtoAST = ParseImport()) {
-    if (auto *FnIR = ProtoAST->codegen()) {
-      fprintf(stderr, "Read extern: ");
-      FnIR->print(errs());
-      fprintf(stderr, "\n");
-    }
-  } else {
-    // Skip token for error recovery.
-    getNextToken();
+/// getBenchStatistic - The Aggregate ("mean", "median" or "stddev") of V.
+static double getBenchStatistic(StringRef Aggregate, std::vector<double> V) {
+  double Mean = 0;
+  for (double X : V)
+    Mean += X / V.size();
+  if (Aggregate == "mean")
+    return Mean;
+  if (Aggregate == "median") {
+    llvm::sort(V);
+    size_t Mid = V.size() / 2;
+    return V.size() % 2 ? V[Mid] : (V[Mid - 1] + V[Mid]) / 2;
   }
+  double Squares = 0;
+  for (double X : V)
+    Squares += (X - Mean) * (X - Mean);
+  return std::sqrt(Squares / (V.size() - 1));
 }
 
-static void HandleTopLevelExpression() {
-  // Evaluate a top-level expression into an anonymous function.
-  if (auto FnAST = ParseTopLevelExpr()) {
-    if (auto *FnIR = FnAST->codegen()) {
-      fprintf(stderr, "Read top-level expression:");
-      FnIR->print(errs());
-      fprintf(stderr, "\n");
+/// RunBenchmarks - Run every -bench workload and write the report. Returns
+/// the process exit code.
+static int RunBenchmarks(const char *Argv0) {
+  TheTargetMachine = createHostTargetMachine();
+  if (!TheTargetMachine)
+    return 1;
+  InitializeModule();
 
-      // Remove the anonymous expression.
-      FnIR->eraseFromParent();
-    }
-  } else {
-    // Skip token for error recovery.
-    getNextToken();
+  std::string ParseSource = makeBenchSource("p", BenchTerms);
+  std::string SmallSource = makeBenchSource("f", 8);
+  orc::WorkStealingPool Pool;
+  // Each workload is told which run it is, so that the ones adding to the
+  // JIT can give every run's definitions their own names.
+  std::vector<std::function<BenchResult(unsigned)>> Workloads = {
+      [&](unsigned) { return benchLexer(ParseSource); },
+      [&](unsigned) { return benchParser(ParseSource); },
+      [&](unsigned) { return benchCodegen(SmallSource); },
+  };
+  if (TheJIT) {
+    Workloads.push_back([](unsigned Run) {
+      return benchJIT(makeBenchSource(("f" + Twine(Run) + "x").str(), 8));
+    });
+    Workloads.push_back(benchTailRecursion);
+    Workloads.push_back(benchForLoop);
+    Workloads.push_back([&](unsigned Run) {
+      return benchEvaluate("BM_EvaluateKernel", true, Run, Pool);
+    });
+    Workloads.push_back([&](unsigned Run) {
+      return benchEvaluate("BM_EvaluateScalar", false, Run, Pool);
+    });
   }
-}
 
-/// top ::= definition | external | expression | ';'
-static void MainLoop() {
-  while (true) {
-    fprintf(stderr, "is-> ");
-    switch (CurTok) {
-    case tok_eof:
-      return;
-    case ';': // ignore top-level semicolons.
-      getNextToken();
-      break;
-    case tok_fun:
-      HandleDefinition();
-      break;
-    case tok_imp:
-      HandleExtern();
-      break;
-    default:
-      HandleTopLevelExpression();
-      break;
+  // Run 0 warms up caches and the allocator and is not reported. With
+  // several repetitions, their mean, median and standard deviation follow
+  // them, as Google Benchmark reports them.
+  json::Array Benchmarks;
+  for (size_t Family = 0; Family != Workloads.size(); ++Family) {
+    Workloads[Family](0);
+    std::vector<BenchResult> Runs;
+    std::vector<double> RealNs, CPUNs;
+    for (unsigned Run = 1; Run <= BenchRepetitions; ++Run) {
+      BenchResult R = Workloads[Family](Run);
+      double Items = R.Items ? double(R.Items) : 1;
+      RealNs.push_back(R.Seconds * 1e9 / Items);
+      CPUNs.push_back(R.CPUSeconds * 1e9 / Items);
+      addBenchRow(Benchmarks, R, Family, Run - 1, RealNs.back(),
+                  CPUNs.back());
+      Runs.push_back(std::move(R));
     }
+    if (Runs.size() < 2)
+      continue;
+    for (StringRef Aggregate : {"mean", "median", "stddev"})
+      addBenchRow(Benchmarks, Runs.front(), Family, 0,
+                  getBenchStatistic(Aggregate, RealNs),
+                  getBenchStatistic(Aggregate, CPUNs), Aggregate);
   }
+  json::Object Report{
+      {"context", json::Object{{"executable", Argv0},
+                               {"num_cpus", int64_t(std::thread::hardware_concurrency())},
+                               {"llvm_version", LLVM_VERSION_STRING},
+                               {"opt_level", std::string("-O") + char(OptLevel)},
+                               {"bench_size", int64_t(BenchSize)},
+                               {"bench_repetitions",
+                                int64_t(BenchRepetitions)}}},
+      {"benchmarks", std::move(Benchmarks)},
+  };
+
+  std::error_code EC;
+  raw_fd_ostream OS(BenchOutput, EC, sys::fs::OF_Text);
+  if (EC) {
+    errs() << Argv0 << ": could not open '" << BenchOutput
+           << "': " << EC.message() << "\n";
+    return 1;
+  }
+  OS << formatv("{0:2}", json::Value(std::move(Report))) << "\n";
+  return 0;
 }
 
 //===----------------------------------------------------------------------===//
 // Main driver code.
 //===----------------------------------------------------------------------===//
 
-int main() {
-  // Install standard binary operators.
-  // 1 is lowest precedence.
-  BinopPrecedence['<'] = 10;
-  BinopPrecedence['+'] = 20;
-  BinopPrecedence['-'] = 20;
-  BinopPrecedence['*'] = 40; // highest.
+/// CompileSingleInput - Run the REPL on stdin, or compile a single input file.
+/// Returns the process exit code.
+static int CompileSingleInput(const char *Argv0) {
+  // Read the whole input file up front; "-" keeps the interactive stdin REPL.
+  std::unique_ptr<Lexer> Lex;
+  if (!InputFilenames.empty() && InputFilenames[0] != "-") {
+    auto BufOrErr = MemoryBuffer::getFile(InputFilenames[0]);
+    if (std::error_code EC = BufOrErr.getError()) {
+      errs() << Argv0 << ": could not open '" << InputFilenames[0]
+             << "': " << EC.message() << "\n";
+      return 1;
+    }
+    Lex = std::make_unique<Lexer>(std::move(*BufOrErr));
+  } else {
+    Lex = std::make_unique<Lexer>();
+  }
+  Parser P(*Lex);
+
+  // Without this, a partial batch would wait for the next item however
+  // quiet the pipe goes.
+  if (ExprBatchMs && isBatchingExprs(P))
+    Lex->setIdleHandler(runPendingBatchWhenDue);
 
   // Prime the first token.
-  fprintf(stderr, "Isere Version alpha 0.1");
-  fprintf(stderr, "is->");
-  getNextToken();
+  if (P.isInteractive()) {
+    fprintf(stderr, "Isere Version alpha 0.1");
+    fprintf(stderr, "is->");
+  }
+  P.getNextToken();
+
+  TheTargetMachine = createHostTargetMachine();
+  if (!TheTargetMachine)
+    return 1;
 
   // Make the module, which holds all the code.
   InitializeModule();
 
   // Run the main "interpreter loop" now.
-  MainLoop();
+  MainLoop(P);
 
-  // Print out all of the generated code.
-  TheModule->print(errs(), nullptr);
+  // Write out everything that was compiled.
+  if (Emit != EmitKind::JIT) {
+    optimizeModule(*TheModule);
+    StringRef Input = InputFilenames.empty() ? "-" : InputFilenames[0];
+    if (!emitModule(*TheModule, *TheTargetMachine, getOutputFilename(Input)))
+      return 1;
+  }
 
   return 0;
 }
+
+int main(int argc, char **argv) {
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+  InitializeNativeTargetAsmParser();
+
+  cl::ParseCommandLineOptions(argc, argv, "Isere compiler and REPL\n");
+  if (OptLevel < '0' || OptLevel > '3') {
+    errs() << argv[0] << ": invalid optimization level -O" << OptLevel << "\n";
+    return 1;
+  }
+  // Tiering recompiles hot definitions between top-level expressions, but
+  // several inputs are compiled whole on worker threads and then run.
+  if (Tiered && InputFilenames.size() > 1) {
+    errs() << argv[0]
+           << ": warning: -tiered is ignored with multiple input files\n";
+    Tiered = false;
+  }
+
+  if (Emit == EmitKind::JIT) {
+    if (!CacheDir.empty())
+      TheObjectCache = std::make_unique<orc::DiskObjectCache>(CacheDir);
+    TheJIT = ExitOnErr(
+        orc::IsereJIT::Create(TheObjectCache.get(), configureJITTarget));
+    if (LazyCompile) {
+      auto TM = createHostTargetMachine();
+      if (!TM)
+        return 1;
+      auto Optimizer =
+          std::make_shared<LazyOptimizer>(std::move(TM), InlineBodies);
+      TheJIT->setOptimizer([Optimizer](orc::ThreadSafeModule TSM,
+                                       orc::MaterializationResponsibility &R) {
+        return (*Optimizer)(std::move(TSM), R);
+      });
+    }
+  } else if (!OutputFilename.empty() && InputFilenames.size() > 1) {
+    errs() << argv[0] << ": cannot specify -o with multiple input files\n";
+    return 1;
+  }
+
+  if (!TimeTraceFile.empty())
+    timeTraceProfilerInitialize(TimeTraceGranularity, argv[0]);
+
+  // Several inputs go through the parallel batch driver.
+  int ExitCode = !BenchOutput.empty()          ? RunBenchmarks(argv[0])
+                 : InputFilenames.size() > 1
+                     ? CompileFilesInParallel(InputFilenames)
+                     : CompileSingleInput(argv[0]);
+
+  printTimeReport();
+  if (TheJIT)
+    dumpFunctionStats();
+  if (!TimeTraceFile.empty()) {
+    if (auto Err = timeTraceProfilerWrite(TimeTraceFile, "isere")) {
+      logAllUnhandledErrors(std::move(Err), errs(), "Error: ");
+      ExitCode = 1;
+    }
+    timeTraceProfilerCleanup();
+  }
+
+  return ExitCode;
+}